@@ -3,9 +3,11 @@
 
 #ifdef __cplusplus
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #else
 #include <linux/types.h>
+#include <linux/string.h>
 #endif
 
 #ifdef __cplusplus
@@ -41,6 +43,17 @@ typedef struct __attribute__((packed))
   int32_t tgid;   //! PID
 } lsp_cred_t;
 
+//! identity and change markers of the file, a consumer may cache per-file results keyed on them
+typedef struct __attribute__((packed))
+{
+  uint64_t dev;        //! device, as st_dev
+  uint64_t ino;        //! inode number, as st_ino
+  uint64_t version;    //! i_version, 0 if the filesystem does not maintain it
+  int64_t ctime_sec;   //! inode change time
+  uint32_t ctime_nsec;
+  uint64_t size;       //! file size at open
+} lsp_inode_t;
+
 typedef struct __attribute__((packed))
 {
   uint32_t code;        //! op, i.e. OPEN
@@ -50,6 +63,26 @@ typedef struct __attribute__((packed))
   char data[];          //! storage of ls_event_field_t
 } lsp_event_t;
 
+//! field 0 is the file path, field 1 the issuer exe path
+#define LSP_EVENT_FIELD_EXT 2
+
+//! the binary value of field LSP_EVENT_FIELD_EXT, it extends the header while
+//! keeping the header and the path fields in their original places;
+//! members are only ever appended, a shorter value comes from an older layout
+typedef struct __attribute__((packed))
+{
+  uint64_t cgroup;      //! issuer cgroup v2 id, 0 if unknown
+  uint32_t sampled_out; //! events dropped by quotas that this one stands for, see lsp_quota_charge()
+  lsp_inode_t inode;    //! opened file inode at open
+  uint64_t time_ns;     //! CLOCK_REALTIME of the capture
+} lsp_event_ext_t;
+
+//! whole record size as it appears in the events stream
+static inline uint32_t lsp_event_size(const lsp_event_t * event)
+{
+  return (uint32_t)sizeof(lsp_event_t) + event->data_size;
+}
+
 static inline lsp_event_field_t * lsp_event_field_first(lsp_event_t * event)
 {
   return (lsp_event_field_t *)(event->data);
@@ -114,6 +147,18 @@ static inline const lsp_event_field_t * lsp_event_field_get_const (const lsp_eve
   return field;
 }
 
+//! copies the extension into ext, the members missing from the record are zeroed;
+//! returns 0 if the record has no extension
+static inline int lsp_event_ext_get(const lsp_event_t * event, lsp_event_ext_t * ext)
+{
+  const lsp_event_field_t * field = lsp_event_field_get_const(event, LSP_EVENT_FIELD_EXT);
+  memset(ext, 0, sizeof(lsp_event_ext_t));
+  if (!field || field >= lsp_event_field_end(event) || field->number != LSP_EVENT_FIELD_EXT)
+    return 0;
+  memcpy(ext, field->value, (field->size < sizeof(lsp_event_ext_t) ? field->size : sizeof(lsp_event_ext_t)));
+  return 1;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -1,7 +1,10 @@
 #include "lsp_event.h"
 #include "lsp_kevent.h"
 #include "lsp_listener.h"
+#include "lsp_quota.h"
+#include "lsp_lane.h"
 
+#include <linux/kernel.h>
 #include <linux/printk.h>
 #include <linux/err.h>
 #include <linux/errno.h>
@@ -19,6 +22,10 @@ struct lsp_fs
   struct dentry * root;
   struct dentry * events;
   struct dentry * tamper;
+  struct dentry * retain;
+  struct dentry * quota;
+  struct dentry * critical;
+  struct dentry * lanes;
 };
 
 static struct lsp_fs lsp_fs = {.root = NULL, .events = NULL};
@@ -32,6 +39,18 @@ static ssize_t lsp_fs_events_read(struct file *, char __user *, size_t, loff_t *
 
 static ssize_t lsp_fs_tamper_write(struct file *, const char __user *, size_t, loff_t *);
 
+static ssize_t lsp_fs_retain_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t lsp_fs_retain_write(struct file *, const char __user *, size_t, loff_t *);
+
+static ssize_t lsp_fs_quota_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t lsp_fs_quota_write(struct file *, const char __user *, size_t, loff_t *);
+
+static ssize_t lsp_fs_critical_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t lsp_fs_critical_write(struct file *, const char __user *, size_t, loff_t *);
+
+static ssize_t lsp_fs_lanes_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t lsp_fs_lanes_write(struct file *, const char __user *, size_t, loff_t *);
+
 // ---------------------------------------------------------------------------
 
 static struct file_operations lsp_fs_events_fops =
@@ -48,22 +67,49 @@ static struct file_operations lsp_fs_tamper_fops =
   , .write = lsp_fs_tamper_write
 };
 
+static struct file_operations lsp_fs_retain_fops =
+{
+  .owner = THIS_MODULE
+  , .read = lsp_fs_retain_read
+  , .write = lsp_fs_retain_write
+};
+
+static struct file_operations lsp_fs_quota_fops =
+{
+  .owner = THIS_MODULE
+  , .read = lsp_fs_quota_read
+  , .write = lsp_fs_quota_write
+};
+
+static struct file_operations lsp_fs_critical_fops =
+{
+  .owner = THIS_MODULE
+  , .read = lsp_fs_critical_read
+  , .write = lsp_fs_critical_write
+};
+
+static struct file_operations lsp_fs_lanes_fops =
+{
+  .owner = THIS_MODULE
+  , .read = lsp_fs_lanes_read
+  , .write = lsp_fs_lanes_write
+};
+
+static const char * const lsp_fs_lane_names[LSP_LANE_COUNT] =
+{
+  [LSP_LANE_CRITICAL] = "critical"
+  , [LSP_LANE_BULK] = "bulk"
+};
+
 // ---------------------------------------------------------------------------
 
 static int lsp_fs_events_open(struct inode *inode, struct file *file)
 {
-  if (!file->private_data)
-  {
-    file->private_data = kmalloc(LSP_EVENT_MAX_SIZE, GFP_KERNEL);
-    if (unlikely(!file->private_data))
-      return -ENOMEM;
-  }
-  else
-    return -ENOMEM;
-
   if (lsp_listenerq_empty())
     atomic_set(&lsp_release, 0);
 
+  lsp_keventq_trim();
+
   return lsp_listenerq_add(current->tgid);
 }
 
@@ -72,16 +118,11 @@ static int lsp_fs_events_open(struct inode *inode, struct file *file)
 static int lsp_fs_events_release(struct inode *inode, struct file *file)
 {
   lsp_listenerq_remove(current->tgid);
-  BUG_ON(!file->private_data);
-  if (file->private_data)
-  {
-    kfree(file->private_data);
-    file->private_data = NULL;
-  }
 
   if (lsp_listenerq_empty())
   {
-    lsp_keventq_clear();
+    if (!lsp_keventq_retaining())
+      lsp_keventq_clear();
     atomic_set(&lsp_release, 0);
   }
   else
@@ -93,39 +134,26 @@ static int lsp_fs_events_release(struct inode *inode, struct file *file)
 
 static ssize_t lsp_fs_events_read(struct file *file, char __user * dst, size_t avail_size, loff_t *pos)
 {
-  lsp_kevent_t * kevent = NULL;
-  ssize_t rv = -EINVAL;
-
   if (unlikely(!file || !dst))
   {
     pr_err("%s: invalid arguments\n", __func__);
     return -EINVAL;
   }
-  if (unlikely(!file->private_data))
-  {
-    pr_err("%s: no listener buffer found\n", __func__);
-    return -EINVAL;
-  }
 
   while (lsp_keventq_empty() && !atomic_read(&lsp_release))
   {
     if (unlikely(file->f_flags & O_NONBLOCK))
       return -EAGAIN;
-    wait_event_interruptible(lsp_kevent_available, (!lsp_keventq_empty() || atomic_read(&lsp_release)));
+    // a signal ends the read, the reader of an idle queue must be able to exit
+    if (wait_event_interruptible(lsp_kevent_available, (!lsp_keventq_empty() || atomic_read(&lsp_release))))
+      return -ERESTARTSYS;
   }
 
   if (atomic_read(&lsp_release))
     return 0;
 
-  kevent = lsp_keventq_pop();
-  if (unlikely(!kevent))
-    return -EAGAIN;
-
-  rv = lsp_kevent_serialize_to_user(kevent, file->private_data, LSP_EVENT_MAX_SIZE, dst, avail_size);
-
-  lsp_kevent_put(kevent);
-
-  return rv;
+  // drain as many events as fit, the stream is delimited by lsp_event_t headers
+  return lsp_keventq_serialize_to_user(dst, avail_size);
 }
 
 // ---------------------------------------------------------------------------
@@ -144,9 +172,179 @@ static ssize_t lsp_fs_tamper_write(struct file *file, const char __user * buf, s
 
 // ---------------------------------------------------------------------------
 
+static ssize_t lsp_fs_retain_read(struct file *file, char __user * buf, size_t size, loff_t *pos)
+{
+  char value[64];
+  int len = 0;
+  lsp_keventq_retention_t retention;
+
+  lsp_keventq_retention(&retention);
+  len = scnprintf(value, sizeof(value), "%zu %u %lu\n"
+      , retention.max_bytes
+      , retention.max_age
+      , retention.dropped
+      );
+  return simple_read_from_buffer(buf, size, pos, value, len);
+}
+
+// ---------------------------------------------------------------------------
+
+//! accepts "<max_bytes> [<max_age_seconds>]", zero max_bytes disables retention
+static ssize_t lsp_fs_retain_write(struct file *file, const char __user * buf, size_t size, loff_t *pos)
+{
+  char value[32] = {0};
+  size_t max_bytes = 0;
+  unsigned int max_age = 0;
+
+  if (unlikely(size >= sizeof(value)))
+    return -EINVAL;
+  if (unlikely(copy_from_user(value, buf, size)))
+    return -EFAULT;
+  if (unlikely(sscanf(value, "%zu %u", &max_bytes, &max_age) < 1))
+    return -EINVAL;
+
+  lsp_keventq_retain(max_bytes, max_age);
+  if (!max_bytes && lsp_listenerq_empty())
+    lsp_keventq_clear();
+  return size;
+}
+
+// ---------------------------------------------------------------------------
+
+static ssize_t lsp_fs_quota_read(struct file *file, char __user * buf, size_t size, loff_t *pos)
+{
+  char value[64];
+  int len = 0;
+  lsp_quota_limits_t limits;
+
+  lsp_quota_get(&limits);
+  len = scnprintf(value, sizeof(value), "%u %u %u %u\n"
+      , limits.cgroup_rate
+      , limits.cgroup_burst
+      , limits.tgid_rate
+      , limits.tgid_burst
+      );
+  return simple_read_from_buffer(buf, size, pos, value, len);
+}
+
+// ---------------------------------------------------------------------------
+
+//! accepts "<cgroup_rate> <cgroup_burst> <tgid_rate> <tgid_burst>", zero rate disables the limit
+static ssize_t lsp_fs_quota_write(struct file *file, const char __user * buf, size_t size, loff_t *pos)
+{
+  char value[64] = {0};
+  lsp_quota_limits_t limits;
+
+  if (unlikely(size >= sizeof(value)))
+    return -EINVAL;
+  if (unlikely(copy_from_user(value, buf, size)))
+    return -EFAULT;
+  if (unlikely(sscanf(value, "%u %u %u %u"
+	  , &limits.cgroup_rate
+	  , &limits.cgroup_burst
+	  , &limits.tgid_rate
+	  , &limits.tgid_burst
+	  ) != 4))
+    return -EINVAL;
+
+  lsp_quota_set(&limits);
+  return size;
+}
+
+// ---------------------------------------------------------------------------
+
+static ssize_t lsp_fs_critical_read(struct file *file, char __user * buf, size_t size, loff_t *pos)
+{
+  char * value = NULL;
+  ssize_t len = 0;
+
+  value = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (unlikely(!value))
+    return -ENOMEM;
+  len = lsp_lane_rules_get(value, PAGE_SIZE);
+  len = simple_read_from_buffer(buf, size, pos, value, len);
+  kfree(value);
+  return len;
+}
+
+// ---------------------------------------------------------------------------
+
+//! accepts newline-separated path prefixes of the critical events, replaces the previous ones
+static ssize_t lsp_fs_critical_write(struct file *file, const char __user * buf, size_t size, loff_t *pos)
+{
+  char * value = NULL;
+  int err = 0;
+
+  if (unlikely(size > PAGE_SIZE))
+    return -EINVAL;
+  value = memdup_user(buf, size);
+  if (unlikely(IS_ERR(value)))
+    return PTR_ERR(value);
+  err = lsp_lane_rules_set(value, size);
+  kfree(value);
+  return (err ? err : size);
+}
+
+// ---------------------------------------------------------------------------
+
+static ssize_t lsp_fs_lanes_read(struct file *file, char __user * buf, size_t size, loff_t *pos)
+{
+  char value[160];
+  int len = 0;
+  int lane = 0;
+  lsp_keventq_lane_t stats;
+
+  for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
+  {
+    lsp_keventq_lane_get(lane, &stats);
+    len += scnprintf(value + len, sizeof(value) - len, "%s %zu %s %zu %lu\n"
+	, lsp_fs_lane_names[lane]
+	, stats.capacity
+	, (stats.policy == LSP_LANE_DROP_NEWEST ? "newest" : "oldest")
+	, stats.count
+	, stats.dropped
+	);
+  }
+  return simple_read_from_buffer(buf, size, pos, value, len);
+}
+
+// ---------------------------------------------------------------------------
+
+//! accepts "<critical|bulk> <capacity> [oldest|newest]", zero capacity leaves the lane unbounded
+static ssize_t lsp_fs_lanes_write(struct file *file, const char __user * buf, size_t size, loff_t *pos)
+{
+  char value[64] = {0};
+  char name[16] = {0};
+  char policy[16] = "oldest";
+  size_t capacity = 0;
+  int lane = 0;
+
+  if (unlikely(size >= sizeof(value)))
+    return -EINVAL;
+  if (unlikely(copy_from_user(value, buf, size)))
+    return -EFAULT;
+  if (unlikely(sscanf(value, "%15s %zu %15s", name, &capacity, policy) < 2))
+    return -EINVAL;
+  if (unlikely(strcmp(policy, "oldest") && strcmp(policy, "newest")))
+    return -EINVAL;
+
+  for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
+  {
+    if (strcmp(name, lsp_fs_lane_names[lane]) == 0)
+    {
+      lsp_keventq_lane_set(lane, capacity, (strcmp(policy, "newest") ? LSP_LANE_DROP_OLDEST : LSP_LANE_DROP_NEWEST));
+      return size;
+    }
+  }
+  return -EINVAL;
+}
+
+// ---------------------------------------------------------------------------
+
 static int __init lsp_create_fs(void)
 {
   struct dentry * dentry = NULL;
+  int err = 0;
 
   if (unlikely(lsp_fs.root))
   {
@@ -154,10 +352,15 @@ static int __init lsp_create_fs(void)
     return -EEXIST;
   }
 
+  err = lsp_kevent_staging_create();
+  if (unlikely(err))
+    return err;
+
   dentry = securityfs_create_dir("lsprobe", NULL);
   if (unlikely(IS_ERR(dentry)))
   {
     pr_err("lsprobe: lsp_fs root error: %ld\n", PTR_ERR(dentry));
+    lsp_kevent_staging_destroy();
     return PTR_ERR(dentry);
   }
   lsp_fs.root = dentry;
@@ -178,13 +381,54 @@ static int __init lsp_create_fs(void)
   }
   lsp_fs.tamper = dentry;
 
+  dentry = securityfs_create_file("retain", 0600, lsp_fs.root, NULL, &lsp_fs_retain_fops);
+  if (unlikely(IS_ERR(dentry)))
+  {
+    pr_err("lsprobe: lsp_fs retain error: %ld\n", PTR_ERR(dentry));
+    goto error;
+  }
+  lsp_fs.retain = dentry;
+
+  dentry = securityfs_create_file("quota", 0600, lsp_fs.root, NULL, &lsp_fs_quota_fops);
+  if (unlikely(IS_ERR(dentry)))
+  {
+    pr_err("lsprobe: lsp_fs quota error: %ld\n", PTR_ERR(dentry));
+    goto error;
+  }
+  lsp_fs.quota = dentry;
+
+  dentry = securityfs_create_file("critical", 0600, lsp_fs.root, NULL, &lsp_fs_critical_fops);
+  if (unlikely(IS_ERR(dentry)))
+  {
+    pr_err("lsprobe: lsp_fs critical error: %ld\n", PTR_ERR(dentry));
+    goto error;
+  }
+  lsp_fs.critical = dentry;
+
+  dentry = securityfs_create_file("lanes", 0600, lsp_fs.root, NULL, &lsp_fs_lanes_fops);
+  if (unlikely(IS_ERR(dentry)))
+  {
+    pr_err("lsprobe: lsp_fs lanes error: %ld\n", PTR_ERR(dentry));
+    goto error;
+  }
+  lsp_fs.lanes = dentry;
+
   return 0;
 
 error:
+  if (lsp_fs.critical)
+    securityfs_remove(lsp_fs.critical);
+  if (lsp_fs.quota)
+    securityfs_remove(lsp_fs.quota);
+  if (lsp_fs.retain)
+    securityfs_remove(lsp_fs.retain);
+  if (lsp_fs.tamper)
+    securityfs_remove(lsp_fs.tamper);
   if (lsp_fs.events)
     securityfs_remove(lsp_fs.events);
   if (lsp_fs.root)
     securityfs_remove(lsp_fs.root);
+  lsp_kevent_staging_destroy();
   return PTR_ERR(dentry);
 }
 
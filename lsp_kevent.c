@@ -3,18 +3,40 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/math64.h>
 
 #include <linux/slab.h>
 #include <linux/poison.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/limits.h>
+#include <linux/kdev_t.h>
+#include <linux/iversion.h>
+#include <linux/stat.h>
 
 #include <linux/uaccess.h>
 
 // ---------------------------------------------------------------------------
 
 static struct kmem_cache * lsp_kevent_cache = NULL;
-static LIST_HEAD(lsp_keventq);
+static lsp_kevent_staging_t lsp_kevent_staging[LSP_KEVENT_STAGING_COUNT];
 static DEFINE_SPINLOCK(lsp_keventq_lock);
 
+//! one queue per lane, guarded by lsp_keventq_lock
+static lsp_keventq_lane_t lsp_keventq[LSP_LANE_COUNT] =
+{
+  [LSP_LANE_CRITICAL] = {.list = LIST_HEAD_INIT(lsp_keventq[LSP_LANE_CRITICAL].list), .policy = LSP_LANE_DROP_OLDEST}
+  , [LSP_LANE_BULK] = {.list = LIST_HEAD_INIT(lsp_keventq[LSP_LANE_BULK].list), .policy = LSP_LANE_DROP_OLDEST}
+};
+
+// retention state, guarded by lsp_keventq_lock
+static size_t lsp_keventq_bytes = 0;
+static size_t lsp_keventq_max_bytes = 0;
+static u64 lsp_keventq_max_age = 0;
+static unsigned long lsp_keventq_dropped = 0;
+
 DECLARE_WAIT_QUEUE_HEAD(lsp_kevent_available);
 
 // ---------------------------------------------------------------------------
@@ -22,8 +44,37 @@ DECLARE_WAIT_QUEUE_HEAD(lsp_kevent_available);
 static inline void lsp_kevent_destruct(lsp_kevent_t * kevent)
 {
   BUG_ON(!kevent);
-  if (kevent->file) fput(kevent->file);
-  if (kevent->p_file) fput(kevent->p_file);
+  kfree(kevent->paths);
+}
+
+// ---------------------------------------------------------------------------
+
+//! memory held by a queued event, accounted against the retention bound
+static inline size_t lsp_kevent_bytes(const lsp_kevent_t * kevent)
+{
+  return sizeof(lsp_kevent_t) + kevent->file_size + kevent->exe_size;
+}
+
+// ---------------------------------------------------------------------------
+
+//! path of the file or a placeholder, scratch receives the d_path output
+static const char * lsp_kevent_path(const struct file * file, char * scratch, size_t scratch_size, const char * none)
+{
+  const char * value = none;
+  if (file && file->f_path.mnt && file->f_path.dentry)
+  {
+    value = d_path(&file->f_path, scratch, scratch_size);
+    if (unlikely(IS_ERR(value)))
+    {
+      pr_err("lsprobe: %s: d_path failed: %ld\n", __func__, PTR_ERR(value));
+      value = "error";
+    }
+  }
+  else
+  {
+    pr_err("lsprobe: %s: %s\n", __func__, none);
+  }
+  return value;
 }
 
 // ---------------------------------------------------------------------------
@@ -43,31 +94,179 @@ static inline void lsp_kevent_fill_cred(lsp_kevent_t * kevent, const struct task
   put_cred(cred);
 }
 
+//! the change markers are taken at open, the consumer compares them against its cache;
+//! the identity is the one stat(2) reports: btrfs subvolumes and overlayfs report
+//! a st_dev other than that of the superblock, and overlayfs its own st_ino
+static inline void lsp_kevent_fill_inode(lsp_kevent_t * kevent, const struct file * file)
+{
+  struct inode * inode = file_inode(file);
+  struct kstat stat;
+
+  // no revalidation, a network filesystem answers from its attribute cache
+  if (likely(!vfs_getattr_nosec(&file->f_path, &stat, STATX_INO | STATX_CTIME | STATX_SIZE, AT_STATX_DONT_SYNC)))
+  {
+    kevent->ext.inode.dev = huge_encode_dev(stat.dev);
+    kevent->ext.inode.ino = stat.ino;
+    kevent->ext.inode.ctime_sec = stat.ctime.tv_sec;
+    kevent->ext.inode.ctime_nsec = stat.ctime.tv_nsec;
+    kevent->ext.inode.size = stat.size;
+  }
+  else
+  {
+    kevent->ext.inode.dev = huge_encode_dev(inode->i_sb->s_dev);
+    kevent->ext.inode.ino = inode->i_ino;
+    kevent->ext.inode.ctime_sec = inode->i_ctime.tv_sec;
+    kevent->ext.inode.ctime_nsec = inode->i_ctime.tv_nsec;
+    kevent->ext.inode.size = i_size_read(inode);
+  }
+  // querying marks the value as seen, so the next change bumps it
+  kevent->ext.inode.version = (IS_I_VERSION(inode) ? inode_query_iversion(inode) : 0);
+}
+
+//! copies the paths of the file and of the issuer exe into the event, so that
+//! a queued event pins neither the files nor their mounts
+static int lsp_kevent_fill_paths(lsp_kevent_t * kevent, const struct file * file)
+{
+  struct file * exe_file = get_task_exe_file(current);
+  char * file_scratch = NULL;
+  char * exe_scratch = NULL;
+  const char * file_path = NULL;
+  const char * exe_path = NULL;
+  int err = -ENOMEM;
+
+  if (unlikely(!exe_file))
+    return -ENOENT;
+
+  file_scratch = __getname();
+  exe_scratch = __getname();
+  if (likely(file_scratch && exe_scratch))
+  {
+    file_path = lsp_kevent_path(file, file_scratch, PATH_MAX, "no_file");
+    exe_path = lsp_kevent_path(exe_file, exe_scratch, PATH_MAX, "no_process");
+    kevent->file_size = strnlen(file_path, PATH_MAX - 1) + 1;
+    kevent->exe_size = strnlen(exe_path, PATH_MAX - 1) + 1;
+    kevent->paths = kmalloc(kevent->file_size + kevent->exe_size, GFP_KERNEL);
+    if (likely(kevent->paths))
+    {
+      memcpy(kevent->paths, file_path, kevent->file_size - 1);
+      kevent->paths[kevent->file_size - 1] = '\0';
+      memcpy(kevent->paths + kevent->file_size, exe_path, kevent->exe_size - 1);
+      kevent->paths[kevent->file_size + kevent->exe_size - 1] = '\0';
+      err = 0;
+    }
+  }
+  if (exe_scratch)
+    __putname(exe_scratch);
+  if (file_scratch)
+    __putname(file_scratch);
+  fput(exe_file);
+  return err;
+}
+
 static inline lsp_kevent_t * lsp_kevent_construct_file_event(lsp_kevent_t * kevent, lsp_event_code_t code, struct file * file)
 {
   INIT_LIST_HEAD(&kevent->list_node);
+  kevent->paths = NULL;
 
-  kevent->file = get_file(file);
-
-  kevent->p_file = get_task_exe_file(current);
+  if (unlikely(lsp_kevent_fill_paths(kevent, file)))
+    return NULL;
   lsp_kevent_fill_cred(kevent, current);
+  lsp_kevent_fill_inode(kevent, file);
 
   kevent->code = code;
+  kevent->ktime = ktime_get_ns();
+  kevent->ext.time_ns = ktime_get_real_ns();
+  return kevent;
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_keventq_unlink_locked(lsp_kevent_t * kevent)
+{
+  list_del(&kevent->list_node);
+  lsp_keventq[kevent->lane].count--;
+  lsp_keventq_bytes -= lsp_kevent_bytes(kevent);
+}
+
+// ---------------------------------------------------------------------------
 
-  if (unlikely(!kevent->file || !kevent->p_file))
+//! returns the count of events the dropped one stood for, the counters add
+//! those the quotas sampled out so that no drop goes unreported
+static unsigned long lsp_keventq_drop_locked(lsp_kevent_t * kevent)
+{
+  const unsigned long count = 1 + (unsigned long)kevent->ext.sampled_out;
+  lsp_keventq_unlink_locked(kevent);
+  lsp_kevent_destruct(kevent);
+  kmem_cache_free(lsp_kevent_cache, kevent);
+  return count;
+}
+
+// ---------------------------------------------------------------------------
+
+//! drops the oldest events until the queue fits the retention bounds,
+//! the memory bound is met at the expense of the bulk lane first;
+//! returns true if the added event, if any, was dropped too
+static bool lsp_keventq_trim_locked(u64 now, const lsp_kevent_t * added)
+{
+  struct list_head * list;
+  lsp_kevent_t * kevent;
+  bool added_dropped = false;
+  int lane;
+
+  if (lsp_keventq_max_age)
   {
-    lsp_kevent_destruct(kevent);
-    kevent = NULL;
+    for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
+    {
+      list = &lsp_keventq[lane].list;
+      while (!list_empty(list))
+      {
+	kevent = list_first_entry(list, lsp_kevent_t, list_node);
+	if (now - kevent->ktime <= lsp_keventq_max_age)
+	  break;
+	lsp_keventq_dropped += lsp_keventq_drop_locked(kevent);
+      }
+    }
   }
-  return kevent;
+
+  for (lane = LSP_LANE_COUNT - 1; lane >= 0 && lsp_keventq_bytes > lsp_keventq_max_bytes; --lane)
+  {
+    list = &lsp_keventq[lane].list;
+    while (!list_empty(list) && lsp_keventq_bytes > lsp_keventq_max_bytes)
+    {
+      // an event larger than the bound, or one behind critical events
+      // filling it, does not survive its own addition
+      kevent = list_first_entry(list, lsp_kevent_t, list_node);
+      added_dropped |= (kevent == added);
+      lsp_keventq_dropped += lsp_keventq_drop_locked(kevent);
+    }
+  }
+  return added_dropped;
 }
 
 // ---------------------------------------------------------------------------
 
+//! returns NULL if the event is rejected by a full lane or dropped by the retention bound
 static lsp_kevent_t * lsp_keventq_add(lsp_kevent_t * kevent)
 {
+  lsp_keventq_lane_t * lane = &lsp_keventq[kevent->lane];
   spin_lock(&lsp_keventq_lock);
-  list_add_tail(&kevent->list_node, &lsp_keventq);
+  if (lane->capacity && lane->count >= lane->capacity)
+  {
+    if (lane->policy == LSP_LANE_DROP_NEWEST)
+    {
+      lane->dropped += 1 + (unsigned long)kevent->ext.sampled_out;
+      spin_unlock(&lsp_keventq_lock);
+      lsp_kevent_destruct(kevent);
+      kmem_cache_free(lsp_kevent_cache, kevent);
+      return NULL;
+    }
+    lane->dropped += lsp_keventq_drop_locked(list_first_entry(&lane->list, lsp_kevent_t, list_node));
+  }
+  list_add_tail(&kevent->list_node, &lane->list);
+  lane->count++;
+  lsp_keventq_bytes += lsp_kevent_bytes(kevent);
+  if (lsp_keventq_max_bytes && lsp_keventq_trim_locked(kevent->ktime, kevent))
+    kevent = NULL;
   wake_up_interruptible(&lsp_kevent_available);
   spin_unlock(&lsp_keventq_lock);
   return kevent;
@@ -77,19 +276,29 @@ static lsp_kevent_t * lsp_keventq_add(lsp_kevent_t * kevent)
 
 bool lsp_keventq_empty(void)
 {
-  return list_empty(&lsp_keventq);
+  int lane;
+  for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
+    if (!list_empty(&lsp_keventq[lane].list))
+      return false;
+  return true;
 }
 
 // ---------------------------------------------------------------------------
 
+//! the critical lane is drained first
 lsp_kevent_t * lsp_keventq_pop(void)
 {
   lsp_kevent_t * kevent = NULL;
+  int lane;
   spin_lock(&lsp_keventq_lock);
-  if (!list_empty(&lsp_keventq))
+  for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
   {
-    kevent = list_first_entry(&lsp_keventq, lsp_kevent_t, list_node);
-    list_del(&kevent->list_node);
+    if (!list_empty(&lsp_keventq[lane].list))
+    {
+      kevent = list_first_entry(&lsp_keventq[lane].list, lsp_kevent_t, list_node);
+      lsp_keventq_unlink_locked(kevent);
+      break;
+    }
   }
   spin_unlock(&lsp_keventq_lock);
   return kevent;
@@ -97,25 +306,118 @@ lsp_kevent_t * lsp_keventq_pop(void)
 
 // ---------------------------------------------------------------------------
 
+//! returns a popped but not consumed event back to the head of its lane
+void lsp_keventq_requeue(lsp_kevent_t * kevent)
+{
+  BUG_ON(!kevent);
+  spin_lock(&lsp_keventq_lock);
+  list_add(&kevent->list_node, &lsp_keventq[kevent->lane].list);
+  lsp_keventq[kevent->lane].count++;
+  lsp_keventq_bytes += lsp_kevent_bytes(kevent);
+  spin_unlock(&lsp_keventq_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+//! returns popped events back to their lanes in their original order
+static void lsp_keventq_requeue_list(struct list_head * kevents)
+{
+  lsp_kevent_t * kevent;
+  lsp_kevent_t * prev;
+  list_for_each_entry_safe_reverse(kevent, prev, kevents, list_node)
+  {
+    list_del(&kevent->list_node);
+    lsp_keventq_requeue(kevent);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
 void lsp_keventq_clear(void)
 {
   struct list_head * node;
   struct list_head * next_node;
-  lsp_kevent_t * kevent;
+  int lane;
   spin_lock(&lsp_keventq_lock);
-  list_for_each_safe(node, next_node, &lsp_keventq)
-  {
-    kevent = list_entry(node, lsp_kevent_t, list_node);
-    list_del(node);
-    lsp_kevent_destruct(kevent);
-    kmem_cache_free(lsp_kevent_cache, kevent);
-  }
+  for (lane = 0; lane < LSP_LANE_COUNT; ++lane)
+    list_for_each_safe(node, next_node, &lsp_keventq[lane].list)
+      lsp_keventq_drop_locked(list_entry(node, lsp_kevent_t, list_node));
+  spin_unlock(&lsp_keventq_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+//! capacity == 0 leaves the lane unbounded
+void lsp_keventq_lane_set(lsp_lane_t lane, size_t capacity, lsp_lane_policy_t policy)
+{
+  BUG_ON(lane >= LSP_LANE_COUNT);
+  spin_lock(&lsp_keventq_lock);
+  lsp_keventq[lane].capacity = capacity;
+  lsp_keventq[lane].policy = policy;
+  while (capacity && lsp_keventq[lane].count > capacity)
+    lsp_keventq[lane].dropped += lsp_keventq_drop_locked(list_first_entry(&lsp_keventq[lane].list, lsp_kevent_t, list_node));
+  spin_unlock(&lsp_keventq_lock);
+  pr_info("lsprobe: lane %d capacity %zu, drop %s\n", lane, capacity, (policy == LSP_LANE_DROP_NEWEST ? "newest" : "oldest"));
+}
+
+// ---------------------------------------------------------------------------
+
+void lsp_keventq_lane_get(lsp_lane_t lane, lsp_keventq_lane_t * stats)
+{
+  BUG_ON(lane >= LSP_LANE_COUNT || !stats);
+  spin_lock(&lsp_keventq_lock);
+  stats->count = lsp_keventq[lane].count;
+  stats->capacity = lsp_keventq[lane].capacity;
+  stats->policy = lsp_keventq[lane].policy;
+  stats->dropped = lsp_keventq[lane].dropped;
   spin_unlock(&lsp_keventq_lock);
 }
 
 // ---------------------------------------------------------------------------
 
-lsp_kevent_t * lsp_kevent_push(struct file * file)
+void lsp_keventq_retain(size_t max_bytes, unsigned int max_age)
+{
+  spin_lock(&lsp_keventq_lock);
+  lsp_keventq_max_bytes = max_bytes;
+  lsp_keventq_max_age = (u64)max_age * NSEC_PER_SEC;
+  if (lsp_keventq_max_bytes)
+    lsp_keventq_trim_locked(ktime_get_ns(), NULL);
+  spin_unlock(&lsp_keventq_lock);
+  pr_info("lsprobe: retention %zu bytes, %u s\n", max_bytes, max_age);
+}
+
+// ---------------------------------------------------------------------------
+
+void lsp_keventq_retention(lsp_keventq_retention_t * retention)
+{
+  BUG_ON(!retention);
+  spin_lock(&lsp_keventq_lock);
+  retention->max_bytes = lsp_keventq_max_bytes;
+  retention->max_age = (unsigned int)div_u64(lsp_keventq_max_age, NSEC_PER_SEC);
+  retention->dropped = lsp_keventq_dropped;
+  spin_unlock(&lsp_keventq_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+bool lsp_keventq_retaining(void)
+{
+  return (READ_ONCE(lsp_keventq_max_bytes) != 0);
+}
+
+// ---------------------------------------------------------------------------
+
+void lsp_keventq_trim(void)
+{
+  spin_lock(&lsp_keventq_lock);
+  if (lsp_keventq_max_bytes)
+    lsp_keventq_trim_locked(ktime_get_ns(), NULL);
+  spin_unlock(&lsp_keventq_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+lsp_kevent_t * lsp_kevent_create(struct file * file)
 {
   lsp_kevent_t * kevent = kmem_cache_alloc(lsp_kevent_cache, GFP_KERNEL);
   if (unlikely(!kevent))
@@ -124,13 +426,33 @@ lsp_kevent_t * lsp_kevent_push(struct file * file)
   if (unlikely(!lsp_kevent_construct_file_event(kevent, LSP_EVENT_CODE_FILE_OPEN, file)))
   {
     kmem_cache_free(lsp_kevent_cache, kevent);
-    return NULL;
+    return ERR_PTR(-ENOENT);
   }
+  return kevent;
+}
+
+// ---------------------------------------------------------------------------
+
+lsp_kevent_t * lsp_kevent_push(lsp_kevent_t * kevent, u64 cgroup, u32 sampled_out, lsp_lane_t lane)
+{
+  BUG_ON(IS_ERR_OR_NULL(kevent));
+  kevent->ext.cgroup = cgroup;
+  kevent->ext.sampled_out = sampled_out;
+  kevent->lane = lane;
   return lsp_keventq_add(kevent);
 }
 
 // ---------------------------------------------------------------------------
 
+void lsp_kevent_discard(lsp_kevent_t * kevent)
+{
+  BUG_ON(IS_ERR_OR_NULL(kevent));
+  lsp_kevent_destruct(kevent);
+  kmem_cache_free(lsp_kevent_cache, kevent);
+}
+
+// ---------------------------------------------------------------------------
+
 void lsp_kevent_put(lsp_kevent_t * kevent)
 {
   BUG_ON(!kevent);
@@ -144,6 +466,19 @@ void lsp_kevent_put(lsp_kevent_t * kevent)
 
 // ---------------------------------------------------------------------------
 
+static void lsp_kevent_put_list(struct list_head * kevents)
+{
+  lsp_kevent_t * kevent;
+  lsp_kevent_t * next;
+  list_for_each_entry_safe(kevent, next, kevents, list_node)
+  {
+    list_del(&kevent->list_node);
+    lsp_kevent_put(kevent);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
 int lsp_kevent_cache_create(void)
 {
   lsp_kevent_cache =
@@ -173,121 +508,166 @@ void lsp_kevent_cache_destroy(void)
 
 // ---------------------------------------------------------------------------
 
-//! copies to user and shifts to the next field
-static char __user * lsp_kevent_serialize_field_to_user(const char * from, uint32_t size, uint32_t number, char __user * field, uint32_t avail_size)
+//! appends a field to the event, the space is checked by the caller
+static void lsp_kevent_serialize_field(lsp_event_t * event, uint32_t number, const char * value, uint32_t size)
 {
-  BUG_ON(!from);
-  BUG_ON(!field);
-  if (sizeof(uint32_t) + sizeof(uint32_t) + size <= avail_size)
-  {
-    size_t err =
-      copy_to_user(field, &number, sizeof(uint32_t))
-      + copy_to_user(field + sizeof(uint32_t), &size, sizeof(uint32_t))
-      + copy_to_user(field + 2 * sizeof(uint32_t), from, size);
-    if (unlikely(err))
-    {
-      pr_warn("%s: failed to write an event field\n", __func__);
-      return ERR_PTR(-EFAULT);
-    }
-    return (field + 2 * sizeof(uint32_t) + size);
-  }
-  pr_warn("%s: not enough space [%u] to store the value of [%lu] bytes\n"
-      , __func__
-      , avail_size
-      , sizeof(number) + sizeof(size) + size
-      );
-  return ERR_PTR(-EFAULT);
+  lsp_event_field_t * field = (lsp_event_field_t *)(event->data + event->data_size);
+  field->number = number;
+  field->size = size;
+  memcpy(field->value, value, size);
+  event->data_size += sizeof(lsp_event_field_t) + size;
+  event->field_count++;
 }
 
 // ---------------------------------------------------------------------------
 
-ssize_t lsp_kevent_serialize_to_user(lsp_kevent_t * kevent, char * buffer, size_t buffer_size, char __user * dst, size_t avail_size)
+//! builds the record in the kernel buffer, returns its size or -ENOSPC
+static ssize_t lsp_kevent_serialize(lsp_kevent_t * kevent, char * dst, size_t avail_size)
 {
-  char __user * field = NULL;
-  lsp_event_t __user * event = NULL;
-  char * value = NULL;
-  size_t value_size = 0;
+  lsp_event_t * event = (lsp_event_t *)dst;
 
-  BUG_ON(!kevent);
-  if (unlikely(!kevent || !buffer || !dst))
-    return -EINVAL;
+  if (sizeof(lsp_event_t) + 3 * sizeof(lsp_event_field_t) + kevent->file_size + kevent->exe_size + sizeof(lsp_event_ext_t) > avail_size)
+    return -ENOSPC;
 
-  event = (lsp_event_t __user *)dst;
   event->code = kevent->code;
   event->pcred = kevent->p_cred;
   event->data_size = 0;
   event->field_count = 0;
-  field = event->data;
+  lsp_kevent_serialize_field(event, 0, kevent->paths, kevent->file_size);
+  lsp_kevent_serialize_field(event, 1, kevent->paths + kevent->file_size, kevent->exe_size);
+  lsp_kevent_serialize_field(event, LSP_EVENT_FIELD_EXT, (const char *)&kevent->ext, sizeof(lsp_event_ext_t));
 
-  value = "no_file";
-  // --- filename
-  if (kevent->file && kevent->file->f_path.mnt && kevent->file->f_path.dentry)
-  {
-    value = d_path(&kevent->file->f_path, buffer, buffer_size);
-    if (unlikely(IS_ERR(value)))
-    {
-      pr_err("lsprobe: %s: d_path on filename failed: %ld\n", __func__, PTR_ERR(value));
-      value = "error";
-    }
-  }
-  else
-  {
-    pr_err("lsprobe: %s: no file specified\n", __func__);
-  }
+  pr_debug("lsprobe: tgid[%u] real[%u:%u] saved[%u:%u] eff[%u:%u] fs[%u:%u] : [%u] : %s\n"
+      , event->pcred.tgid
+      , event->pcred.uid
+      , event->pcred.gid
+      , event->pcred.suid
+      , event->pcred.sgid
+      , event->pcred.euid
+      , event->pcred.egid
+      , event->pcred.fsuid
+      , event->pcred.fsgid
+      , event->code
+      , lsp_event_field_first_const(event)->value
+      );
 
-  value_size = strnlen(value, buffer_size - 1) + 1;
+  return lsp_event_size(event);
+}
 
-  field = lsp_kevent_serialize_field_to_user(value, value_size, 0, field, avail_size);
-  if (unlikely(IS_ERR(field)))
-    return PTR_ERR(field);
+// ---------------------------------------------------------------------------
 
-  event->data_size += value_size;
-  event->field_count++;
-  avail_size -= value_size;
+//! copies the staged records, the staged events are released once delivered
+//! and left to the caller to requeue otherwise, so a faulting reader loses none
+static int lsp_kevent_flush_to_user(char __user * dst, const char * record, size_t staged, struct list_head * kevents)
+{
+  if (unlikely(copy_to_user(dst, record, staged)))
+  {
+    pr_warn("%s: failed to copy %zu bytes of events\n", __func__, staged);
+    return -EFAULT;
+  }
+  lsp_kevent_put_list(kevents);
+  return 0;
+}
 
-  value = "no_process";
+// ---------------------------------------------------------------------------
 
-  if (kevent->p_file && kevent->p_file->f_path.mnt && kevent->p_file->f_path.dentry)
+//! drains as many queued events as fit into dst, each staging buffer worth of
+//! records is copied with a single copy_to_user
+ssize_t lsp_keventq_serialize_to_user(char __user * dst, size_t avail_size)
+{
+  lsp_kevent_staging_t * staging = NULL;
+  lsp_kevent_t * kevent = NULL;
+  LIST_HEAD(staged_kevents);
+  size_t copied = 0;
+  size_t staged = 0;
+  ssize_t rv = -EAGAIN;
+
+  // readers are few, they share a small pool, the mutex keeps the buffer ours if we migrate
+  staging = &lsp_kevent_staging[raw_smp_processor_id() % LSP_KEVENT_STAGING_COUNT];
+  mutex_lock(&staging->lock);
+  if (unlikely(!staging->record))
   {
-    // --- issuer
-    value = d_path(&kevent->p_file->f_path, buffer, buffer_size);
-    if (unlikely(IS_ERR(value)))
+    staging->record = kvmalloc(LSP_KEVENT_STAGING_SIZE, GFP_KERNEL);
+    if (unlikely(!staging->record))
     {
-      pr_err("lsprobe: %s: d_path on process failed: %ld\n", __func__, PTR_ERR(value));
-      value = "error";
+      mutex_unlock(&staging->lock);
+      return -ENOMEM;
     }
   }
-  else
+
+  while (copied + staged < avail_size && (kevent = lsp_keventq_pop()))
   {
-    pr_err("lsprobe: %s: no process specified\n", __func__);
+    rv = lsp_kevent_serialize(kevent, staging->record + staged
+	, min(avail_size - copied, (size_t)LSP_KEVENT_STAGING_SIZE) - staged
+	);
+    if (rv == -ENOSPC && staged)
+    {
+      // flush the full staging buffer and retry
+      rv = lsp_kevent_flush_to_user(dst + copied, staging->record, staged, &staged_kevents);
+      if (unlikely(rv))
+      {
+	list_add_tail(&kevent->list_node, &staged_kevents);
+	lsp_keventq_requeue_list(&staged_kevents);
+	staged = 0;
+	break;
+      }
+      copied += staged;
+      staged = 0;
+      rv = lsp_kevent_serialize(kevent, staging->record
+	  , min(avail_size - copied, (size_t)LSP_KEVENT_STAGING_SIZE)
+	  );
+    }
+    if (rv == -ENOSPC)
+    {
+      lsp_keventq_requeue(kevent);
+      break;
+    }
+    list_add_tail(&kevent->list_node, &staged_kevents);
+    staged += rv;
   }
 
-  value_size = strnlen(value, buffer_size - 1) + 1;
-
-  field = lsp_kevent_serialize_field_to_user(value, value_size, 1, field, avail_size);
-  if (unlikely(IS_ERR(field)))
-    return PTR_ERR(field);
+  if (staged)
+  {
+    if (likely(!lsp_kevent_flush_to_user(dst + copied, staging->record, staged, &staged_kevents)))
+      copied += staged;
+    else
+    {
+      lsp_keventq_requeue_list(&staged_kevents);
+      rv = -EFAULT;
+    }
+  }
 
-  event->data_size += value_size;
-  event->field_count++;
-  avail_size -= value_size;
+  mutex_unlock(&staging->lock);
+  return (copied ? copied : rv);
+}
 
-  pr_info("lsprobe: tgid[%u] real[%u:%u] saved[%u:%u] eff[%u:%u] fs[%u:%u] : [%u] : %s\n"
-      , event->pcred.tgid
-      , event->pcred.uid
-      , event->pcred.gid
-      , event->pcred.suid
-      , event->pcred.sgid
-      , event->pcred.euid
-      , event->pcred.egid
-      , event->pcred.fsuid
-      , event->pcred.fsgid
-      , event->code
-      , lsp_event_field_first_const(event)->value
-      );
+// ---------------------------------------------------------------------------
 
-  return (sizeof(event) + event->data_size);
+//! the buffers are allocated by the first read that uses them, a system
+//! without a reader pays nothing for them
+int lsp_kevent_staging_create(void)
+{
+  int i;
+  for (i = 0; i < LSP_KEVENT_STAGING_COUNT; ++i)
+  {
+    mutex_init(&lsp_kevent_staging[i].lock);
+    lsp_kevent_staging[i].record = NULL;
+  }
+  return 0;
 }
 
 // ---------------------------------------------------------------------------
 
+void lsp_kevent_staging_destroy(void)
+{
+  int i;
+  for (i = 0; i < LSP_KEVENT_STAGING_COUNT; ++i)
+  {
+    mutex_lock(&lsp_kevent_staging[i].lock);
+    kvfree(lsp_kevent_staging[i].record);
+    lsp_kevent_staging[i].record = NULL;
+    mutex_unlock(&lsp_kevent_staging[i].lock);
+  }
+}
+
+// ---------------------------------------------------------------------------
@@ -4,6 +4,7 @@
 // ---------------------------------------------------------------------------
 
 #include "lsp_event.h"
+#include "lsp_lane.h"
 
 #include <linux/types.h>
 #include <linux/cred.h>
@@ -11,25 +12,45 @@
 #include <linux/atomic.h>
 #include <linux/list.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
 
 // ---------------------------------------------------------------------------
 
 typedef struct lsp_kevent
 {
   struct list_head list_node;
-  struct file * file;
-  struct file * p_file;
+  char * paths;   //! file path then exe path, each null-terminated
+  u32 file_size;  //! of the file path, including the null byte
+  u32 exe_size;   //! of the exe path, including the null byte
   lsp_event_code_t code;
   lsp_cred_t p_cred;
+  lsp_event_ext_t ext;
+  u8 lane;    //! lsp_lane_t
+  u64 ktime;  //! monotonic time of capture, ns, for the retention age only; ext.time_ns is the realtime one
 } lsp_kevent_t;
 
+//! reusable buffers of the readers, a few shared by all CPUs
+typedef struct
+{
+  struct mutex lock;
+  char * record; //! records staged for copy_to_user, LSP_KEVENT_STAGING_SIZE, allocated on first read
+} lsp_kevent_staging_t;
+
+#define LSP_KEVENT_STAGING_SIZE (4 * LSP_EVENT_MAX_SIZE)
+#define LSP_KEVENT_STAGING_COUNT 4
+
 // ---------------------------------------------------------------------------
 
 extern wait_queue_head_t lsp_kevent_available;
 
 // ---------------------------------------------------------------------------
 
-lsp_kevent_t * lsp_kevent_push(struct file *);
+//! captures the open of the file, returns an ERR_PTR if it could not be captured
+lsp_kevent_t * lsp_kevent_create(struct file *);
+//! queues a created event, returns NULL if a full lane or the retention bound dropped it
+lsp_kevent_t * lsp_kevent_push(lsp_kevent_t *, u64 cgroup, u32 sampled_out, lsp_lane_t lane);
+//! releases a created event that is not pushed
+void lsp_kevent_discard(lsp_kevent_t *);
 void lsp_kevent_put(lsp_kevent_t *);
 
 // ---------------------------------------------------------------------------
@@ -37,13 +58,46 @@ void lsp_kevent_put(lsp_kevent_t *);
 bool lsp_keventq_empty(void);
 lsp_kevent_t * lsp_keventq_pop(void);
 void lsp_keventq_clear(void);
-ssize_t lsp_kevent_serialize_to_user(lsp_kevent_t * kevent, char * buffer, size_t buffer_size, char __user * dst, size_t avail_size);
+void lsp_keventq_requeue(lsp_kevent_t * kevent);
+ssize_t lsp_keventq_serialize_to_user(char __user * dst, size_t avail_size);
+
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+  struct list_head list;
+  size_t count;
+  size_t capacity;          //! events, 0 - unbounded
+  lsp_lane_policy_t policy; //! what goes when the lane is full
+  unsigned long dropped;    //! events discarded by the capacity, with those they stood for
+} lsp_keventq_lane_t;
+
+void lsp_keventq_lane_set(lsp_lane_t lane, size_t capacity, lsp_lane_policy_t policy);
+void lsp_keventq_lane_get(lsp_lane_t lane, lsp_keventq_lane_t * stats);
+
+// ---------------------------------------------------------------------------
+
+//! retention limits applied to the queue, max_bytes == 0 disables retention
+typedef struct
+{
+  size_t max_bytes;    //! memory bound for queued events
+  unsigned int max_age; //! age bound for queued events, seconds, 0 - none
+  unsigned long dropped; //! events discarded to keep the bounds, with those they stood for
+} lsp_keventq_retention_t;
+
+void lsp_keventq_retain(size_t max_bytes, unsigned int max_age);
+void lsp_keventq_retention(lsp_keventq_retention_t * retention);
+bool lsp_keventq_retaining(void);
+void lsp_keventq_trim(void);
 
 // ---------------------------------------------------------------------------
 
 int lsp_kevent_cache_create(void);
 void lsp_kevent_cache_destroy(void);
 
+int lsp_kevent_staging_create(void);
+void lsp_kevent_staging_destroy(void);
+
 // ---------------------------------------------------------------------------
 
 #endif // LSP_KEVENT_H
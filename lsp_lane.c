@@ -0,0 +1,134 @@
+#include "lsp_lane.h"
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+// ---------------------------------------------------------------------------
+
+//! path prefixes of the critical events, NUL-separated
+typedef struct
+{
+  struct rcu_head rcu;
+  size_t size;
+  char prefixes[];
+} lsp_lane_rules_t;
+
+// ---------------------------------------------------------------------------
+
+static lsp_lane_rules_t __rcu * lsp_lane_rules = NULL;
+static DEFINE_MUTEX(lsp_lane_rules_lock);
+
+// ---------------------------------------------------------------------------
+
+static bool lsp_lane_rules_match(const lsp_lane_rules_t * rules, const char * path)
+{
+  const char * prefix = rules->prefixes;
+  const char * end = rules->prefixes + rules->size;
+  size_t len = 0;
+  while (prefix < end)
+  {
+    len = strlen(prefix);
+    if (strncmp(path, prefix, len) == 0)
+      return true;
+    prefix += len + 1;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+
+//! without rules every event is bulk and the path is not needed to classify it
+bool lsp_lane_rules_active(void)
+{
+  return (rcu_access_pointer(lsp_lane_rules) != NULL);
+}
+
+// ---------------------------------------------------------------------------
+
+//! path is the one captured in the event, so classifying resolves no path
+lsp_lane_t lsp_lane_classify(const char * path)
+{
+  const lsp_lane_rules_t * rules = NULL;
+  lsp_lane_t lane = LSP_LANE_BULK;
+
+  rcu_read_lock();
+  rules = rcu_dereference(lsp_lane_rules);
+  if (rules && lsp_lane_rules_match(rules, path))
+    lane = LSP_LANE_CRITICAL;
+  rcu_read_unlock();
+  return lane;
+}
+
+// ---------------------------------------------------------------------------
+
+//! replaces the rules with the newline-separated prefixes, empty input clears them
+int lsp_lane_rules_set(const char * input, size_t size)
+{
+  lsp_lane_rules_t * rules = NULL;
+  lsp_lane_rules_t * old_rules = NULL;
+  const char * line = input;
+  const char * end = input + size;
+  const char * eol = NULL;
+  size_t len = 0;
+
+  rules = kzalloc(sizeof(lsp_lane_rules_t) + size + 1, GFP_KERNEL);
+  if (unlikely(!rules))
+    return -ENOMEM;
+  for (; line < end; line = eol + 1)
+  {
+    eol = memchr(line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    len = eol - line;
+    if (!len)
+      continue;
+    if (unlikely(memchr(line, '\0', len)))
+    {
+      kfree(rules);
+      return -EINVAL;
+    }
+    memcpy(rules->prefixes + rules->size, line, len);
+    rules->size += len + 1;
+  }
+  if (!rules->size)
+  {
+    kfree(rules);
+    rules = NULL;
+  }
+
+  mutex_lock(&lsp_lane_rules_lock);
+  old_rules = rcu_dereference_protected(lsp_lane_rules, lockdep_is_held(&lsp_lane_rules_lock));
+  rcu_assign_pointer(lsp_lane_rules, rules);
+  mutex_unlock(&lsp_lane_rules_lock);
+
+  if (old_rules)
+    kfree_rcu(old_rules, rcu);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+
+//! newline-separated prefixes, truncated to the buffer size
+ssize_t lsp_lane_rules_get(char * buffer, size_t size)
+{
+  const lsp_lane_rules_t * rules = NULL;
+  size_t len = 0;
+  size_t i = 0;
+
+  rcu_read_lock();
+  rules = rcu_dereference(lsp_lane_rules);
+  if (rules)
+  {
+    len = min(rules->size, size);
+    for (i = 0; i < len; ++i)
+      buffer[i] = (rules->prefixes[i] ? rules->prefixes[i] : '\n');
+  }
+  rcu_read_unlock();
+  return len;
+}
+
+// ---------------------------------------------------------------------------
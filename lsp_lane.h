@@ -0,0 +1,30 @@
+#ifndef LSP_LANE_H
+#define LSP_LANE_H
+
+#include <linux/types.h>
+
+// ---------------------------------------------------------------------------
+
+typedef enum
+{
+  LSP_LANE_CRITICAL = 0 //! drained first
+  , LSP_LANE_BULK = 1
+  , LSP_LANE_COUNT
+} lsp_lane_t;
+
+typedef enum
+{
+  LSP_LANE_DROP_NEWEST = 0 //! a full lane rejects the new event
+  , LSP_LANE_DROP_OLDEST = 1 //! a full lane discards its oldest event
+} lsp_lane_policy_t;
+
+// ---------------------------------------------------------------------------
+
+bool lsp_lane_rules_active(void);
+lsp_lane_t lsp_lane_classify(const char * path);
+int lsp_lane_rules_set(const char * rules, size_t size);
+ssize_t lsp_lane_rules_get(char * buffer, size_t size);
+
+// ---------------------------------------------------------------------------
+
+#endif // LSP_LANE_H
@@ -1,6 +1,8 @@
 
 #include "lsp_kevent.h"
 #include "lsp_listener.h"
+#include "lsp_quota.h"
+#include "lsp_lane.h"
 
 #include <linux/module.h>
 #include <linux/types.h>
@@ -8,12 +10,14 @@
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/lsm_hooks.h>
+#include <linux/cgroup.h>
+#include <linux/rcupdate.h>
 
 // ----------------------------------------------------------------------------
 
 static bool lsp_gotta_push(struct file * file)
 {
-  return (!lsp_listenerq_empty()
+  return ((!lsp_listenerq_empty() || lsp_keventq_retaining())
       && !(current->flags & PF_KTHREAD)
       && !lsp_listenerq_exists(current->tgid)
       && file != NULL
@@ -25,10 +29,50 @@ static bool lsp_gotta_push(struct file * file)
 
 // ----------------------------------------------------------------------------
 
+static u64 lsp_current_cgroup(void)
+{
+  u64 id = 0;
+#ifdef CONFIG_CGROUPS
+  rcu_read_lock();
+  id = cgroup_id(task_dfl_cgroup(current));
+  rcu_read_unlock();
+#endif
+  return id;
+}
+
+// ----------------------------------------------------------------------------
+
 static int lsp_file_open(struct file *file, const struct cred *cred)
 {
+  u64 cgroup = 0;
+  u32 sampled_out = 0;
+  lsp_lane_t lane = LSP_LANE_BULK;
+  lsp_kevent_t * kevent = NULL;
   if (lsp_gotta_push(file))
-    lsp_kevent_push(file);
+  {
+    cgroup = lsp_current_cgroup();
+    // the lane depends on the path, with critical rules the event is captured
+    // ahead of the quotas and its paths are the ones queued for the reader
+    if (lsp_lane_rules_active())
+    {
+      kevent = lsp_kevent_create(file);
+      if (likely(!IS_ERR(kevent)))
+	lane = lsp_lane_classify(kevent->paths);
+    }
+    // critical events are never sampled out by the quotas
+    if (lane == LSP_LANE_CRITICAL || lsp_quota_charge(cgroup, current->tgid, &sampled_out))
+    {
+      if (!kevent)
+	kevent = lsp_kevent_create(file);
+      if (likely(!IS_ERR(kevent)))
+	kevent = lsp_kevent_push(kevent, cgroup, sampled_out, lane);
+      // the event and the drops it stood for go with the next one
+      if (unlikely(IS_ERR(kevent)))
+	lsp_quota_unsent(1 + sampled_out);
+    }
+    else if (!IS_ERR_OR_NULL(kevent))
+      lsp_kevent_discard(kevent);
+  }
   return 0;
 }
 
@@ -0,0 +1,263 @@
+#include "lsp_quota.h"
+
+#include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+// ---------------------------------------------------------------------------
+
+#define LSP_QUOTA_BITS 10
+#define LSP_QUOTA_MAX_BUCKETS (16 << LSP_QUOTA_BITS)
+#define LSP_QUOTA_MAX_PERIOD 1024
+#define LSP_QUOTA_MAX_RATE 1000000
+#define LSP_QUOTA_MAX_ELAPSED (1000 * NSEC_PER_SEC)
+
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+  struct hlist_node node;
+  u64 key;         //! cgroup id or tgid
+  u64 tokens;      //! scaled by NSEC_PER_SEC
+  u64 stamp;       //! of the last refill, ns
+  u32 period;      //! of 1-in-N sampling, 1 while tokens are available
+  u32 skipped;     //! events skipped in the current period
+  u32 sampled_out; //! events dropped since the last emitted one
+} lsp_quota_bucket_t;
+
+typedef struct
+{
+  unsigned int rate;
+  unsigned int burst;
+  unsigned int count;          //! of the chained buckets
+  lsp_quota_bucket_t overflow; //! shared by the keys beyond LSP_QUOTA_MAX_BUCKETS
+  struct hlist_head heads[1 << LSP_QUOTA_BITS];
+} lsp_quota_table_t;
+
+typedef enum
+{
+  LSP_QUOTA_DROP = 0
+  , LSP_QUOTA_ADMIT = 1
+} lsp_quota_verdict_t;
+
+// ---------------------------------------------------------------------------
+
+static lsp_quota_table_t lsp_quota_cgroups;
+static lsp_quota_table_t lsp_quota_tgids;
+static u32 lsp_quota_orphaned = 0; //! dropped counts of evicted buckets
+static DEFINE_SPINLOCK(lsp_quota_lock);
+
+// ---------------------------------------------------------------------------
+
+static void lsp_quota_bucket_init(lsp_quota_table_t * table, lsp_quota_bucket_t * bucket, u64 key, u64 now)
+{
+  bucket->key = key;
+  bucket->tokens = (u64)table->burst * NSEC_PER_SEC;
+  bucket->stamp = now;
+  bucket->period = 1;
+  bucket->skipped = 0;
+  bucket->sampled_out = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+//! a bucket refilled to the burst since its last use is the same as a new one
+static bool lsp_quota_bucket_idle(const lsp_quota_table_t * table, const lsp_quota_bucket_t * bucket, u64 now)
+{
+  const u64 capacity = (u64)table->burst * NSEC_PER_SEC;
+  const u64 elapsed = min_t(u64, now - bucket->stamp, LSP_QUOTA_MAX_ELAPSED);
+  return (elapsed * table->rate >= capacity - min_t(u64, bucket->tokens, capacity));
+}
+
+// ---------------------------------------------------------------------------
+
+//! the bucket of the key, idle buckets of the chain are reaped on the way,
+//! keeping their dropped counts; colliding keys never share or reset a bucket
+static lsp_quota_bucket_t * lsp_quota_bucket(lsp_quota_table_t * table, u64 key, u64 now)
+{
+  struct hlist_head * head = &table->heads[hash_64(key, LSP_QUOTA_BITS)];
+  lsp_quota_bucket_t * found = NULL;
+  lsp_quota_bucket_t * bucket = NULL;
+  struct hlist_node * next = NULL;
+
+  hlist_for_each_entry_safe(bucket, next, head, node)
+  {
+    if (bucket->key == key)
+      found = bucket;
+    else if (lsp_quota_bucket_idle(table, bucket, now))
+    {
+      lsp_quota_orphaned += bucket->sampled_out;
+      hlist_del(&bucket->node);
+      kfree(bucket);
+      table->count--;
+    }
+  }
+  if (found)
+    return found;
+
+  bucket = NULL;
+  if (table->count < LSP_QUOTA_MAX_BUCKETS)
+    bucket = kmalloc(sizeof(lsp_quota_bucket_t), GFP_ATOMIC | __GFP_NOWARN);
+  if (unlikely(!bucket))
+    return &table->overflow;
+  lsp_quota_bucket_init(table, bucket, key, now);
+  hlist_add_head(&bucket->node, head);
+  table->count++;
+  return bucket;
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_quota_table_reset(lsp_quota_table_t * table, unsigned int rate, unsigned int burst, u64 now)
+{
+  lsp_quota_bucket_t * bucket = NULL;
+  struct hlist_node * next = NULL;
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(table->heads); ++i)
+  {
+    hlist_for_each_entry_safe(bucket, next, &table->heads[i], node)
+    {
+      lsp_quota_orphaned += bucket->sampled_out;
+      hlist_del(&bucket->node);
+      kfree(bucket);
+    }
+  }
+  lsp_quota_orphaned += table->overflow.sampled_out;
+  table->count = 0;
+  table->rate = min_t(unsigned int, rate, LSP_QUOTA_MAX_RATE);
+  table->burst = clamp_t(unsigned int, burst, 1, LSP_QUOTA_MAX_RATE);
+  lsp_quota_bucket_init(table, &table->overflow, 0, now);
+}
+
+// ---------------------------------------------------------------------------
+
+static lsp_quota_verdict_t lsp_quota_take(lsp_quota_table_t * table, lsp_quota_bucket_t * bucket, u64 now)
+{
+  const u64 capacity = (u64)table->burst * NSEC_PER_SEC;
+  u64 elapsed = min_t(u64, now - bucket->stamp, LSP_QUOTA_MAX_ELAPSED);
+
+  bucket->stamp = now;
+  bucket->tokens = min_t(u64, bucket->tokens + elapsed * table->rate, capacity);
+  if (bucket->tokens >= NSEC_PER_SEC)
+  {
+    bucket->tokens -= NSEC_PER_SEC;
+    bucket->period = 1;
+    bucket->skipped = 0;
+    return LSP_QUOTA_ADMIT;
+  }
+
+  // out of tokens: pass one of each period events, doubling the period
+  if (++bucket->skipped >= bucket->period)
+  {
+    bucket->skipped = 0;
+    if (bucket->period < LSP_QUOTA_MAX_PERIOD)
+      bucket->period <<= 1;
+    return LSP_QUOTA_ADMIT;
+  }
+  bucket->sampled_out++;
+  return LSP_QUOTA_DROP;
+}
+
+// ---------------------------------------------------------------------------
+
+//! returns whether the event is to be emitted, sampled_out receives the count
+//! of the dropped events it stands for besides itself: those of its tgid and
+//! cgroup buckets, which include the drops of the cgroup-mates, and the ones
+//! left by reaped buckets or unsent events of any issuer; so only the stream-wide
+//! sum of 1 + sampled_out is the count of events, not a per-issuer one
+bool lsp_quota_charge(u64 cgroup, pid_t tgid, u32 * sampled_out)
+{
+  lsp_quota_bucket_t * tgid_bucket = NULL;
+  lsp_quota_bucket_t * cgroup_bucket = NULL;
+  u64 now = 0;
+
+  *sampled_out = 0;
+  if (!READ_ONCE(lsp_quota_tgids.rate)
+      && !READ_ONCE(lsp_quota_cgroups.rate)
+      && !READ_ONCE(lsp_quota_orphaned))
+    return true;
+
+  now = ktime_get_ns();
+  spin_lock(&lsp_quota_lock);
+  if (lsp_quota_tgids.rate)
+  {
+    tgid_bucket = lsp_quota_bucket(&lsp_quota_tgids, (u64)tgid, now);
+    if (lsp_quota_take(&lsp_quota_tgids, tgid_bucket, now) == LSP_QUOTA_DROP)
+      goto drop;
+  }
+  if (lsp_quota_cgroups.rate)
+  {
+    // the root cgroup id is 1, 0 is only reported without cgroups
+    cgroup_bucket = lsp_quota_bucket(&lsp_quota_cgroups, cgroup, now);
+    if (lsp_quota_take(&lsp_quota_cgroups, cgroup_bucket, now) == LSP_QUOTA_DROP)
+      goto drop;
+  }
+
+  *sampled_out = lsp_quota_orphaned;
+  lsp_quota_orphaned = 0;
+  if (tgid_bucket)
+  {
+    *sampled_out += tgid_bucket->sampled_out;
+    tgid_bucket->sampled_out = 0;
+  }
+  if (cgroup_bucket)
+  {
+    *sampled_out += cgroup_bucket->sampled_out;
+    cgroup_bucket->sampled_out = 0;
+  }
+  spin_unlock(&lsp_quota_lock);
+  return true;
+
+drop:
+  spin_unlock(&lsp_quota_lock);
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+
+//! hands back the count of events an admitted but unsent event stood for
+void lsp_quota_unsent(u32 count)
+{
+  spin_lock(&lsp_quota_lock);
+  lsp_quota_orphaned += count;
+  spin_unlock(&lsp_quota_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+void lsp_quota_set(const lsp_quota_limits_t * limits)
+{
+  u64 now = ktime_get_ns();
+  BUG_ON(!limits);
+  spin_lock(&lsp_quota_lock);
+  // the dropped counts are kept to report them with the next event
+  lsp_quota_table_reset(&lsp_quota_cgroups, limits->cgroup_rate, limits->cgroup_burst, now);
+  lsp_quota_table_reset(&lsp_quota_tgids, limits->tgid_rate, limits->tgid_burst, now);
+  spin_unlock(&lsp_quota_lock);
+  pr_info("lsprobe: quota cgroup %u/%u, tgid %u/%u\n"
+      , lsp_quota_cgroups.rate
+      , lsp_quota_cgroups.burst
+      , lsp_quota_tgids.rate
+      , lsp_quota_tgids.burst
+      );
+}
+
+// ---------------------------------------------------------------------------
+
+void lsp_quota_get(lsp_quota_limits_t * limits)
+{
+  BUG_ON(!limits);
+  spin_lock(&lsp_quota_lock);
+  limits->cgroup_rate = lsp_quota_cgroups.rate;
+  limits->cgroup_burst = lsp_quota_cgroups.burst;
+  limits->tgid_rate = lsp_quota_tgids.rate;
+  limits->tgid_burst = lsp_quota_tgids.burst;
+  spin_unlock(&lsp_quota_lock);
+}
+
+// ---------------------------------------------------------------------------
@@ -0,0 +1,26 @@
+#ifndef LSP_QUOTA_H
+#define LSP_QUOTA_H
+
+#include <linux/types.h>
+
+// ---------------------------------------------------------------------------
+
+//! token bucket limits, rate in events per second, zero rate disables the limit
+typedef struct
+{
+  unsigned int cgroup_rate;
+  unsigned int cgroup_burst;
+  unsigned int tgid_rate;
+  unsigned int tgid_burst;
+} lsp_quota_limits_t;
+
+// ---------------------------------------------------------------------------
+
+bool lsp_quota_charge(u64 cgroup, pid_t tgid, u32 * sampled_out);
+void lsp_quota_unsent(u32 count);
+void lsp_quota_set(const lsp_quota_limits_t * limits);
+void lsp_quota_get(lsp_quota_limits_t * limits);
+
+// ---------------------------------------------------------------------------
+
+#endif // LSP_QUOTA_H
@@ -0,0 +1,156 @@
+#ifndef LSP_CAPTURE_H
+#define LSP_CAPTURE_H
+
+// Capture of the raw events stream: lsp_capture_header_t followed by chunks,
+// a chunk is lsp_capture_chunk_t followed by the exact bytes one read() returned.
+
+#include "lsp_stream.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <time.h>
+
+// ---------------------------------------------------------------------------
+
+#define LSP_CAPTURE_MAGIC "LSPCAP04" //! follows the lsp_event_t layout
+
+typedef struct __attribute__((packed))
+{
+  char magic[8];
+  uint64_t start_ns; //! CLOCK_REALTIME when the recording started
+} lsp_capture_header_t;
+
+typedef struct __attribute__((packed))
+{
+  uint64_t offset_ns; //! CLOCK_MONOTONIC since the recording started
+  uint32_t size;
+  uint32_t reserved;
+} lsp_capture_chunk_t;
+
+// ---------------------------------------------------------------------------
+
+namespace lsp_capture
+{
+
+inline uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+
+class writer
+{
+public:
+  explicit writer(const std::string & name)
+    : file_(fopen(name.c_str(), "wb"))
+    , started_(clock_ns(CLOCK_MONOTONIC))
+  {
+    if (!file_)
+      throw std::system_error(errno, std::generic_category(), name);
+    lsp_capture_header_t header;
+    memcpy(header.magic, LSP_CAPTURE_MAGIC, sizeof(header.magic));
+    header.start_ns = clock_ns(CLOCK_REALTIME);
+    if (fwrite(&header, sizeof(header), 1, file_) != 1)
+    {
+      const int err = errno;
+      fclose(file_);
+      throw std::system_error(err, std::generic_category(), name);
+    }
+  }
+
+  ~writer()
+  {
+    if (file_)
+      fclose(file_);
+  }
+
+  writer(const writer &) = delete;
+  writer & operator=(const writer &) = delete;
+
+  void append(const char * data, uint32_t size)
+  {
+    lsp_capture_chunk_t chunk = {clock_ns(CLOCK_MONOTONIC) - started_, size, 0};
+    if (fwrite(&chunk, sizeof(chunk), 1, file_) != 1 || fwrite(data, size, 1, file_) != 1)
+      throw std::system_error(errno, std::generic_category(), "capture write");
+  }
+
+  void flush()
+  {
+    if (fflush(file_) != 0)
+      throw std::system_error(errno, std::generic_category(), "capture flush");
+  }
+
+private:
+  FILE * file_;
+  uint64_t started_;
+};
+
+// ---------------------------------------------------------------------------
+
+//! the whole capture in memory, so the replay is not bound by the disk
+class reader
+{
+public:
+  struct chunk
+  {
+    uint64_t offset_ns;
+    const char * data;
+    uint32_t size;
+  };
+
+  explicit reader(const std::string & name)
+  {
+    FILE * file = fopen(name.c_str(), "rb");
+    if (!file)
+      throw std::system_error(errno, std::generic_category(), name);
+    lsp_capture_header_t header;
+    bool ok = (fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, LSP_CAPTURE_MAGIC, sizeof(header.magic)) == 0);
+    lsp_capture_chunk_t c;
+    std::vector<std::pair<uint64_t, uint32_t>> layout;
+    while (ok && fread(&c, sizeof(c), 1, file) == 1)
+    {
+      const size_t offset = data_.size();
+      data_.resize(offset + c.size);
+      if (fread(data_.data() + offset, c.size, 1, file) != 1)
+      {
+	// a truncated tail chunk of an interrupted recording
+	data_.resize(offset);
+	break;
+      }
+      layout.emplace_back((uint64_t)c.offset_ns, (uint32_t)c.size);
+    }
+    fclose(file);
+    if (!ok)
+      throw std::runtime_error("not a capture: " + name);
+
+    start_ns_ = header.start_ns;
+    size_t offset = 0;
+    for (const auto & l : layout)
+    {
+      chunks_.push_back({l.first, data_.data() + offset, l.second});
+      offset += l.second;
+    }
+  }
+
+  const std::vector<chunk> & chunks() const { return chunks_; }
+  uint64_t start_ns() const { return start_ns_; }
+  uint64_t bytes() const { return data_.size(); }
+
+private:
+  std::vector<char> data_;
+  std::vector<chunk> chunks_;
+  uint64_t start_ns_ = 0;
+};
+
+} // namespace lsp_capture
+
+#endif // LSP_CAPTURE_H
@@ -0,0 +1,334 @@
+#ifndef LSP_HASH_H
+#define LSP_HASH_H
+
+// File content hashing with a cache keyed on the file identity (dev, ino)
+// and validated by the change markers lsprobe reports at open: i_version,
+// ctime and size. A file is reread only when one of them has changed.
+//
+// Without i_version (0, e.g. ext4 without iversion) only ctime and size are
+// left, and ctime moves in clock ticks: a same-size write in the tick of the
+// read leaves the markers as they were. As in git's racy index rule, a digest
+// is then not cached while the ctime is within racy_margin_ns of the time the
+// hash finished; the file is hashed again on its next event.
+
+#include "../lsp_event.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------------------
+
+namespace lsp_hash
+{
+
+typedef std::array<uint8_t, 32> digest_t;
+
+//! FIPS 180-4 SHA-256
+class sha256
+{
+public:
+  sha256() { reset(); }
+
+  void reset()
+  {
+    static const uint32_t init[8] =
+    {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state_, init, sizeof(state_));
+    length_ = 0;
+    pending_ = 0;
+  }
+
+  void update(const void * data, size_t size)
+  {
+    const uint8_t * p = (const uint8_t *)data;
+    length_ += size;
+    if (pending_)
+    {
+      const size_t n = std::min(size, sizeof(block_) - pending_);
+      memcpy(block_ + pending_, p, n);
+      pending_ += n;
+      p += n;
+      size -= n;
+      if (pending_ < sizeof(block_))
+	return;
+      compress(block_);
+      pending_ = 0;
+    }
+    for (; size >= sizeof(block_); p += sizeof(block_), size -= sizeof(block_))
+      compress(p);
+    memcpy(block_, p, size);
+    pending_ = size;
+  }
+
+  digest_t finish()
+  {
+    const uint64_t bits = length_ * 8;
+    const uint8_t pad = 0x80;
+    const uint8_t zero[64] = {0};
+    update(&pad, 1);
+    update(zero, (pending_ <= 56 ? 56 - pending_ : 120 - pending_));
+    uint8_t tail[8];
+    for (int i = 0; i < 8; ++i)
+      tail[i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(tail, sizeof(tail));
+    digest_t digest;
+    for (int i = 0; i < 8; ++i)
+      for (int j = 0; j < 4; ++j)
+	digest[4 * i + j] = (uint8_t)(state_[i] >> (24 - 8 * j));
+    return digest;
+  }
+
+private:
+  static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void compress(const uint8_t * block)
+  {
+    static const uint32_t k[64] =
+    {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5
+      , 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174
+      , 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da
+      , 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967
+      , 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85
+      , 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070
+      , 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3
+      , 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; ++i)
+    {
+      const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; ++i)
+    {
+      const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+    state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+  }
+
+  uint32_t state_[8];
+  uint8_t block_[64];
+  uint64_t length_;
+  size_t pending_;
+};
+
+// ---------------------------------------------------------------------------
+
+inline std::string to_hex(const digest_t & digest)
+{
+  static const char hex[] = "0123456789abcdef";
+  std::string s;
+  for (uint8_t b : digest)
+  {
+    s += hex[b >> 4];
+    s += hex[b & 0xf];
+  }
+  return s;
+}
+
+// ---------------------------------------------------------------------------
+
+//! the file content as of the change markers, i.e. those of an event
+inline bool same_markers(const lsp_inode_t & inode, const struct stat & st)
+{
+  return (uint64_t)st.st_dev == inode.dev
+    && (uint64_t)st.st_ino == inode.ino
+    && (int64_t)st.st_ctim.tv_sec == inode.ctime_sec
+    && (uint32_t)st.st_ctim.tv_nsec == inode.ctime_nsec
+    && (uint64_t)st.st_size == inode.size;
+}
+
+// ---------------------------------------------------------------------------
+
+enum class status
+{
+  stable   //! hashed, the digest is as of the event markers
+  , changed //! hashed, but the file changed since the event, not cacheable
+  , racy    //! hashed, the markers cannot tell a change in the same tick yet, not cacheable
+  , failed  //! errno is set
+};
+
+//! a ctime granule is a few ms, the margin is that of a coarse filesystem
+constexpr int64_t racy_margin_ns = 1000000000;
+
+//! hashes the file at path, the markers are checked before and after the read
+//! so that a digest of content other than the event's one is never cached
+inline status hash_file(const char * path, const lsp_inode_t & inode, std::vector<char> & buffer, digest_t & digest, uint64_t & bytes)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd < 0 && errno == EPERM)
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return status::failed;
+
+  struct stat before;
+  struct stat after;
+  if (fstat(fd, &before) != 0)
+  {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return status::failed;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  sha256 hasher;
+  for (;;)
+  {
+    const ssize_t rv = read(fd, buffer.data(), buffer.size());
+    if (rv < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      const int err = errno;
+      close(fd);
+      errno = err;
+      return status::failed;
+    }
+    if (rv == 0)
+      break;
+    hasher.update(buffer.data(), rv);
+    bytes += rv;
+  }
+  digest = hasher.finish();
+  const bool stable = (fstat(fd, &after) == 0 && same_markers(inode, before) && same_markers(inode, after));
+  close(fd);
+  if (!stable)
+    return status::changed;
+  if (inode.version == 0)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const int64_t ctime_ns = inode.ctime_sec * 1000000000LL + inode.ctime_nsec;
+    if ((int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - ctime_ns < racy_margin_ns)
+      return status::racy;
+  }
+  return status::stable;
+}
+
+// ---------------------------------------------------------------------------
+
+//! LRU of digests keyed on (dev, ino), an entry is valid while the markers match
+class cache
+{
+public:
+  struct stats
+  {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t stale = 0;     //! misses on a changed file
+    uint64_t evictions = 0;
+  };
+
+  explicit cache(size_t capacity)
+    : capacity_(capacity)
+  {
+    map_.reserve(capacity);
+  }
+
+  const digest_t * find(const lsp_inode_t & inode)
+  {
+    const auto it = map_.find(key{inode.dev, inode.ino});
+    if (it == map_.end())
+    {
+      ++stats_.misses;
+      return nullptr;
+    }
+    const entry & e = *it->second;
+    if (e.version != inode.version || e.ctime_sec != inode.ctime_sec || e.ctime_nsec != inode.ctime_nsec || e.size != inode.size)
+    {
+      ++stats_.misses;
+      ++stats_.stale;
+      lru_.erase(it->second);
+      map_.erase(it);
+      return nullptr;
+    }
+    ++stats_.hits;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return &it->second->digest;
+  }
+
+  void insert(const lsp_inode_t & inode, const digest_t & digest)
+  {
+    const key k{inode.dev, inode.ino};
+    const auto it = map_.find(k);
+    if (it != map_.end())
+    {
+      lru_.erase(it->second);
+      map_.erase(it);
+    }
+    else if (map_.size() >= capacity_ && !lru_.empty())
+    {
+      map_.erase(key{lru_.back().dev, lru_.back().ino});
+      lru_.pop_back();
+      ++stats_.evictions;
+    }
+    lru_.push_front({inode.dev, inode.ino, inode.version, inode.ctime_sec, inode.ctime_nsec, inode.size, digest});
+    map_.emplace(k, lru_.begin());
+  }
+
+  size_t size() const { return map_.size(); }
+  const stats & get_stats() const { return stats_; }
+
+private:
+  struct key
+  {
+    uint64_t dev;
+    uint64_t ino;
+    bool operator==(const key & other) const { return dev == other.dev && ino == other.ino; }
+  };
+
+  struct key_hash
+  {
+    size_t operator()(const key & k) const { return std::hash<uint64_t>()(k.ino * 0x9e3779b97f4a7c15ULL ^ k.dev); }
+  };
+
+  struct entry
+  {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t version;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint64_t size;
+    digest_t digest;
+  };
+
+  size_t capacity_;
+  std::list<entry> lru_;
+  std::unordered_map<key, std::list<entry>::iterator, key_hash> map_;
+  stats stats_;
+};
+
+} // namespace lsp_hash
+
+#endif // LSP_HASH_H
@@ -0,0 +1,224 @@
+// Reference consumer hashing every opened file, with a cache keyed on the inode markers
+//
+// usage: lsp_hashd [<events_file> | - | --capture <capture> [--loop <n>]] [--no-cache] [--capacity <n>] [--print]
+//
+// The events come from the events file (the default), stdin ("-", e.g. fed by
+// lsp_replay play) or in-process from a lsp_replay capture. The files are those
+// of field 0 and are hashed with SHA-256 unless the cache holds a digest for
+// the same (dev, ino) with the same i_version, ctime and size.
+// --no-cache rehashes on every event, to measure what the cache saves.
+
+#include "lsp_capture.h"
+#include "lsp_hash.h"
+
+#include <cinttypes>
+#include <csignal>
+#include <cstdlib>
+
+#include <sys/resource.h>
+
+// ---------------------------------------------------------------------------
+
+static volatile sig_atomic_t lsp_hashd_stop = 0;
+
+static void lsp_hashd_on_signal(int)
+{
+  lsp_hashd_stop = 1;
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_hashd_usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [<events_file> | - | --capture <capture> [--loop <n>]] [--no-cache] [--capacity <n>] [--print]\n", name);
+}
+
+// ---------------------------------------------------------------------------
+
+class lsp_hashd
+{
+public:
+  lsp_hashd(bool use_cache, size_t capacity, bool print)
+    : use_cache_(use_cache)
+    , print_(print)
+    , cache_(capacity)
+    , buffer_(1 << 20)
+  {
+  }
+
+  void on_event(const lsp_event_t * event)
+  {
+    ++events_;
+    const std::string_view path = lsp_stream::field_value(event, 0);
+    if (path.empty() || path[0] != '/')
+    {
+      ++skipped_;
+      return;
+    }
+    lsp_event_ext_t ext;
+    if (!lsp_event_ext_get(event, &ext))
+    {
+      ++skipped_;
+      return;
+    }
+    const lsp_inode_t inode = ext.inode;
+
+    const lsp_hash::digest_t * cached = (use_cache_ ? cache_.find(inode) : nullptr);
+    if (cached)
+    {
+      if (print_)
+	printf("%s %s\n", lsp_hash::to_hex(*cached).c_str(), path.data());
+      return;
+    }
+
+    lsp_hash::digest_t digest;
+    switch (lsp_hash::hash_file(path.data(), inode, buffer_, digest, bytes_))
+    {
+      case lsp_hash::status::stable:
+	++hashed_;
+	if (use_cache_)
+	  cache_.insert(inode, digest);
+	break;
+      case lsp_hash::status::changed:
+	++hashed_;
+	++changed_;
+	break;
+      case lsp_hash::status::racy:
+	++hashed_;
+	++racy_;
+	break;
+      case lsp_hash::status::failed:
+	++failed_;
+	return;
+    }
+    if (print_)
+      printf("%s %s\n", lsp_hash::to_hex(digest).c_str(), path.data());
+  }
+
+  void report(double seconds) const
+  {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    const lsp_hash::cache::stats & stats = cache_.get_stats();
+    fprintf(stderr
+	, "lsp_hashd: %" PRIu64 " events, %" PRIu64 " hashed (%.1f MB), %" PRIu64 " changed while hashed, %" PRIu64 " too recent to cache, %" PRIu64 " failed, %" PRIu64 " skipped\n"
+	  "lsp_hashd: cache %zu entries, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " stale, %" PRIu64 " evictions\n"
+	  "lsp_hashd: %.3f s, cpu %.3f s, %.1f us cpu/event\n"
+	, events_, hashed_, bytes_ / 1e6, changed_, racy_, failed_, skipped_
+	, cache_.size(), stats.hits, stats.misses, stats.stale, stats.evictions
+	, seconds, cpu, (events_ ? cpu * 1e6 / events_ : 0.0)
+	);
+  }
+
+private:
+  bool use_cache_;
+  bool print_;
+  lsp_hash::cache cache_;
+  std::vector<char> buffer_;
+  uint64_t events_ = 0;
+  uint64_t hashed_ = 0;
+  uint64_t bytes_ = 0;
+  uint64_t changed_ = 0;
+  uint64_t racy_ = 0;
+  uint64_t failed_ = 0;
+  uint64_t skipped_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+
+static int lsp_hashd_stream(lsp_hashd & hashd, const char * events_name)
+{
+  const bool from_stdin = (strcmp(events_name, "-") == 0);
+  int fd = (from_stdin ? STDIN_FILENO : open(events_name, O_RDONLY | O_CLOEXEC));
+  if (fd < 0)
+  {
+    perror(events_name);
+    return EXIT_FAILURE;
+  }
+
+  lsp_stream::splitter splitter;
+  std::vector<char> buffer(1 << 20);
+  while (!lsp_hashd_stop)
+  {
+    ssize_t rv = read(fd, buffer.data(), buffer.size());
+    if (rv < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      perror(events_name);
+      break;
+    }
+    if (rv == 0)
+      break;
+    splitter.feed(buffer.data(), rv, [&](const lsp_event_t * event) { hashd.on_event(event); });
+  }
+  if (!from_stdin)
+    close(fd);
+  return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+
+static int lsp_hashd_capture(lsp_hashd & hashd, const char * capture_name, uint64_t loops)
+{
+  try
+  {
+    const lsp_capture::reader capture(capture_name);
+    lsp_stream::splitter splitter;
+    for (uint64_t loop = 0; loop < loops && !lsp_hashd_stop; ++loop)
+      for (const lsp_capture::reader::chunk & chunk : capture.chunks())
+	splitter.feed(chunk.data, chunk.size, [&](const lsp_event_t * event) { hashd.on_event(event); });
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_hashd: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  const char * events_name = "/sys/kernel/security/lsprobe/events";
+  const char * capture_name = nullptr;
+  uint64_t loops = 1;
+  bool use_cache = true;
+  size_t capacity = 1 << 20;
+  bool print = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if (arg == "--capture" && i + 1 < argc)
+      capture_name = argv[++i];
+    else if (arg == "--loop" && i + 1 < argc)
+      loops = strtoull(argv[++i], nullptr, 10);
+    else if (arg == "--no-cache")
+      use_cache = false;
+    else if (arg == "--capacity" && i + 1 < argc)
+      capacity = strtoull(argv[++i], nullptr, 10);
+    else if (arg == "--print")
+      print = true;
+    else if (arg == "-" || arg[0] != '-')
+      events_name = argv[i];
+    else
+    {
+      lsp_hashd_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = lsp_hashd_on_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  lsp_hashd hashd(use_cache, capacity, print);
+  const uint64_t started_ns = lsp_capture::clock_ns(CLOCK_MONOTONIC);
+  const int rv = (capture_name ? lsp_hashd_capture(hashd, capture_name, loops) : lsp_hashd_stream(hashd, events_name));
+  hashd.report((lsp_capture::clock_ns(CLOCK_MONOTONIC) - started_ns) / 1e9);
+  return rv;
+}
@@ -0,0 +1,632 @@
+#ifndef LSP_LOG_H
+#define LSP_LOG_H
+
+// On-disk event log: a directory of segments, each segment is a pair of files
+//   <seq>.lsd - data: lsp_log_segment_header_t followed by records
+//   <seq>.lsi - indexes, written when the segment is sealed
+// A record is lsp_log_record_t followed by the raw lsp_event_t padded to 8 bytes.
+// Records are in ingest order, which is not the capture time order: critical
+// events overtake bulk ones and a retained backlog arrives late, hence the
+// time index covers every record.
+
+#include "lsp_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------------------
+
+#define LSP_LOG_DATA_MAGIC "LSPLOGD1"
+#define LSP_LOG_INDEX_MAGIC "LSPLOGI1"
+#define LSP_LOG_VERSION 6 //! follows the lsp_event_t layout
+
+typedef struct __attribute__((packed))
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t seq;
+} lsp_log_segment_header_t;
+
+typedef struct __attribute__((packed))
+{
+  uint64_t time_ns; //! CLOCK_REALTIME of the capture, of the ingest if the event lacks it
+  uint32_t size;    //! size of the raw event following the record
+  uint32_t reserved;
+} lsp_log_record_t;
+
+typedef struct __attribute__((packed))
+{
+  uint64_t key;
+  uint64_t offset; //! of lsp_log_record_t in the data file
+} lsp_log_index_entry_t;
+
+typedef enum
+{
+  LSP_LOG_INDEX_TIME = 0 //! time_ns -> offset
+  , LSP_LOG_INDEX_PATH = 1  //! hash of field 0 -> offset
+  , LSP_LOG_INDEX_UID = 2   //! real uid -> offset
+  , LSP_LOG_INDEX_EXE = 3   //! hash of field 1 -> offset
+  , LSP_LOG_INDEX_INODE = 4 //! inode_key() of the opened file -> offset
+  , LSP_LOG_INDEX_COUNT
+} lsp_log_index_kind_t;
+
+typedef struct __attribute__((packed))
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t record_count;
+  uint64_t first_ns; //! earliest time_ns
+  uint64_t last_ns;  //! latest time_ns
+  uint64_t data_size; //! size of the data file at sealing
+  uint64_t index_offset[LSP_LOG_INDEX_COUNT]; //! in the index file
+  uint64_t index_count[LSP_LOG_INDEX_COUNT];
+} lsp_log_index_header_t;
+
+// ---------------------------------------------------------------------------
+
+namespace lsp_log
+{
+
+inline uint64_t hash(std::string_view value)
+{
+  // FNV-1a, stable across builds since it is stored on disk
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : value)
+  {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline uint64_t inode_key(uint64_t dev, uint64_t ino)
+{
+  const uint64_t value[2] = {dev, ino};
+  return hash(std::string_view((const char *)value, sizeof(value)));
+}
+
+inline uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+inline uint64_t align8(uint64_t size)
+{
+  return (size + 7) & ~7ULL;
+}
+
+inline bool key_less(const lsp_log_index_entry_t & l, const lsp_log_index_entry_t & r)
+{
+  return l.key < r.key;
+}
+
+inline std::string segment_name(const std::string & dir, uint64_t seq, const char * ext)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx%s", (unsigned long long)seq, ext);
+  return dir + name;
+}
+
+// ---------------------------------------------------------------------------
+
+//! collects the index entries of a segment and writes its index file
+class index_builder
+{
+public:
+  void add(const lsp_event_t * event, uint64_t time_ns, uint64_t offset)
+  {
+    first_ns_ = (count_ ? std::min(first_ns_, time_ns) : time_ns);
+    last_ns_ = (count_ ? std::max(last_ns_, time_ns) : time_ns);
+    index_[LSP_LOG_INDEX_TIME].push_back({time_ns, offset});
+    index_[LSP_LOG_INDEX_PATH].push_back({hash(lsp_stream::field_value(event, 0)), offset});
+    index_[LSP_LOG_INDEX_UID].push_back({event->pcred.uid, offset});
+    index_[LSP_LOG_INDEX_EXE].push_back({hash(lsp_stream::field_value(event, 1)), offset});
+    lsp_event_ext_t ext;
+    if (lsp_event_ext_get(event, &ext))
+      index_[LSP_LOG_INDEX_INODE].push_back({inode_key(ext.inode.dev, ext.inode.ino), offset});
+    ++count_;
+  }
+
+  //! data_size is the end of the last complete record
+  void write(const std::string & dir, uint64_t seq, uint64_t data_size)
+  {
+    lsp_log_index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LSP_LOG_INDEX_MAGIC, sizeof(header.magic));
+    header.version = LSP_LOG_VERSION;
+    header.record_count = count_;
+    header.first_ns = first_ns_;
+    header.last_ns = last_ns_;
+    header.data_size = data_size;
+
+    uint64_t offset = sizeof(header);
+    for (int kind = 0; kind < LSP_LOG_INDEX_COUNT; ++kind)
+    {
+      // ties keep the data order
+      std::stable_sort(index_[kind].begin(), index_[kind].end(), key_less);
+      header.index_offset[kind] = offset;
+      header.index_count[kind] = index_[kind].size();
+      offset += index_[kind].size() * sizeof(lsp_log_index_entry_t);
+    }
+
+    const std::string name = segment_name(dir, seq, ".lsi");
+    const std::string tmp_name = name + ".tmp";
+    FILE * index = fopen(tmp_name.c_str(), "wb");
+    if (!index)
+      throw std::system_error(errno, std::generic_category(), tmp_name);
+    bool ok = (fwrite(&header, sizeof(header), 1, index) == 1);
+    for (int kind = 0; ok && kind < LSP_LOG_INDEX_COUNT; ++kind)
+      ok = (fwrite(index_[kind].data(), sizeof(lsp_log_index_entry_t), index_[kind].size(), index) == index_[kind].size());
+    ok = (fclose(index) == 0) && ok;
+    if (!ok || rename(tmp_name.c_str(), name.c_str()) != 0)
+      throw std::system_error(errno, std::generic_category(), name);
+    clear();
+  }
+
+  void clear()
+  {
+    for (auto & entries : index_)
+      entries.clear();
+    count_ = 0;
+  }
+
+private:
+  uint64_t count_ = 0;
+  uint64_t first_ns_ = 0;
+  uint64_t last_ns_ = 0;
+  std::vector<lsp_log_index_entry_t> index_[LSP_LOG_INDEX_COUNT];
+};
+
+// ---------------------------------------------------------------------------
+
+//! appends events to the active segment and seals it into data and index files
+class writer
+{
+public:
+  writer(std::string dir, uint64_t seq, uint64_t segment_size)
+    : dir_(std::move(dir))
+    , seq_(seq)
+    , segment_size_(segment_size)
+  {
+  }
+
+  ~writer()
+  {
+    try
+    {
+      seal();
+    }
+    catch (const std::exception & e)
+    {
+      fprintf(stderr, "lsp_log: %s\n", e.what());
+    }
+  }
+
+  writer(const writer &) = delete;
+  writer & operator=(const writer &) = delete;
+
+  //! appends a single raw event, the event must be complete;
+  //! ingest_ns stands for the capture time of an event without one
+  void append(const lsp_event_t * event, uint64_t ingest_ns)
+  {
+    if (!data_)
+      open_segment();
+
+    lsp_event_ext_t ext;
+    const uint64_t time_ns = (lsp_event_ext_get(event, &ext) && ext.time_ns ? ext.time_ns : ingest_ns);
+
+    lsp_log_record_t record = {time_ns, lsp_event_size(event), 0};
+    const uint64_t offset = offset_;
+    const uint64_t padding = align8(record.size) - record.size;
+    static const char zeroes[8] = {0};
+
+    if (fwrite(&record, sizeof(record), 1, data_) != 1
+	|| fwrite(event, record.size, 1, data_) != 1
+	|| fwrite(zeroes, padding, 1, data_) != (padding ? 1U : 0U))
+      throw std::system_error(errno, std::generic_category(), "segment write");
+    offset_ += sizeof(record) + record.size + padding;
+    index_.add(event, time_ns, offset);
+
+    if (offset_ >= segment_size_)
+      seal();
+  }
+
+  //! splits a buffer returned by read() on the events file, returns consumed size
+  size_t append_stream(const char * buffer, size_t size, uint64_t ingest_ns)
+  {
+    return lsp_stream::for_each_event(buffer, size, [&](const lsp_event_t * event) { append(event, ingest_ns); });
+  }
+
+  //! hands the buffered records to the kernel, so that they survive a crash
+  //! of the writer and an unsealed segment query sees them
+  void flush()
+  {
+    if (data_ && fflush(data_) != 0)
+      throw std::system_error(errno, std::generic_category(), "segment flush");
+  }
+
+  //! flushes the active segment and writes its indexes
+  void seal()
+  {
+    if (!data_)
+      return;
+    if (fclose(data_) != 0)
+      throw std::system_error(errno, std::generic_category(), "segment close");
+    data_ = nullptr;
+    index_.write(dir_, seq_, offset_);
+    ++seq_;
+  }
+
+  uint64_t seq() const { return seq_; }
+
+private:
+  void open_segment()
+  {
+    const std::string name = segment_name(dir_, seq_, ".lsd");
+    data_ = fopen(name.c_str(), "wbx");
+    if (!data_)
+      throw std::system_error(errno, std::generic_category(), name);
+    setvbuf(data_, nullptr, _IOFBF, 1 << 20);
+
+    lsp_log_segment_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LSP_LOG_DATA_MAGIC, sizeof(header.magic));
+    header.version = LSP_LOG_VERSION;
+    header.seq = seq_;
+    if (fwrite(&header, sizeof(header), 1, data_) != 1 || fflush(data_) != 0)
+      throw std::system_error(errno, std::generic_category(), name);
+    offset_ = sizeof(header);
+  }
+
+  std::string dir_;
+  uint64_t seq_;
+  uint64_t segment_size_;
+  FILE * data_ = nullptr;
+  uint64_t offset_ = 0;
+  index_builder index_;
+};
+
+// ---------------------------------------------------------------------------
+
+//! read-only memory mapping of a file
+class mapping
+{
+public:
+  mapping() = default;
+
+  explicit mapping(const std::string & name)
+  {
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), name);
+    // an empty file, e.g. of a crash right after its creation, is not mappable
+    int err = EINVAL;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      err = errno;
+    else if (st.st_size > 0)
+    {
+      void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED)
+      {
+	addr_ = (const char *)addr;
+	size_ = st.st_size;
+      }
+      else
+	err = errno;
+    }
+    close(fd);
+    if (!addr_)
+      throw std::system_error(err, std::generic_category(), name);
+  }
+
+  ~mapping()
+  {
+    if (addr_)
+      munmap((void *)addr_, size_);
+  }
+
+  mapping(mapping && other) noexcept
+    : addr_(other.addr_)
+    , size_(other.size_)
+  {
+    other.addr_ = nullptr;
+    other.size_ = 0;
+  }
+
+  mapping & operator=(mapping && other) noexcept
+  {
+    std::swap(addr_, other.addr_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  const char * data() const { return addr_; }
+  size_t size() const { return size_; }
+
+private:
+  const char * addr_ = nullptr;
+  size_t size_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+
+//! a mapped segment, indexes are optional - an unsealed segment is scanned
+class segment
+{
+public:
+  segment(const std::string & dir, uint64_t seq)
+    : data_(segment_name(dir, seq, ".lsd"))
+  {
+    const lsp_log_segment_header_t * header = (const lsp_log_segment_header_t *)data_.data();
+    if (data_.size() < sizeof(*header) || memcmp(header->magic, LSP_LOG_DATA_MAGIC, sizeof(header->magic)) != 0)
+      throw std::runtime_error("not a segment: " + segment_name(dir, seq, ".lsd"));
+    if (header->version != LSP_LOG_VERSION)
+      throw std::runtime_error("unsupported segment version: " + segment_name(dir, seq, ".lsd"));
+    end_ = data_.size();
+
+    try
+    {
+      index_ = mapping(segment_name(dir, seq, ".lsi"));
+    }
+    catch (const std::system_error &)
+    {
+      return;
+    }
+    const lsp_log_index_header_t * index = index_header();
+    if (index_.size() < sizeof(*index)
+	|| memcmp(index->magic, LSP_LOG_INDEX_MAGIC, sizeof(index->magic)) != 0
+	|| index->version != LSP_LOG_VERSION
+	|| index->data_size > data_.size())
+    {
+      index_ = mapping();
+      return;
+    }
+    for (int kind = 0; kind < LSP_LOG_INDEX_COUNT; ++kind)
+    {
+      if (index->index_offset[kind] + index->index_count[kind] * sizeof(lsp_log_index_entry_t) > index_.size())
+      {
+	index_ = mapping();
+	return;
+      }
+    }
+    end_ = index->data_size;
+  }
+
+  bool indexed() const { return index_.data() != nullptr; }
+
+  const lsp_log_index_header_t * index_header() const
+  {
+    return (const lsp_log_index_header_t *)index_.data();
+  }
+
+  const lsp_log_index_entry_t * index_begin(lsp_log_index_kind_t kind) const
+  {
+    return (const lsp_log_index_entry_t *)(index_.data() + index_header()->index_offset[kind]);
+  }
+
+  const lsp_log_index_entry_t * index_end(lsp_log_index_kind_t kind) const
+  {
+    return index_begin(kind) + index_header()->index_count[kind];
+  }
+
+  //! entries with the given key, ordered by offset
+  std::pair<const lsp_log_index_entry_t *, const lsp_log_index_entry_t *> lookup(lsp_log_index_kind_t kind, uint64_t key) const
+  {
+    return std::equal_range(index_begin(kind), index_end(kind), lsp_log_index_entry_t{key, 0}, key_less);
+  }
+
+  //! entries with from <= key <= to, ordered by key
+  std::pair<const lsp_log_index_entry_t *, const lsp_log_index_entry_t *> lookup_range(lsp_log_index_kind_t kind, uint64_t from, uint64_t to) const
+  {
+    const lsp_log_index_entry_t * first = std::lower_bound(index_begin(kind), index_end(kind), lsp_log_index_entry_t{from, 0}, key_less);
+    return {first, std::upper_bound(first, index_end(kind), lsp_log_index_entry_t{to, 0}, key_less)};
+  }
+
+  //! record at the offset or nullptr if the offset is past the last complete one
+  const lsp_log_record_t * record(uint64_t offset) const
+  {
+    if (offset + sizeof(lsp_log_record_t) > end_)
+      return nullptr;
+    const lsp_log_record_t * r = (const lsp_log_record_t *)(data_.data() + offset);
+    if (r->size < sizeof(lsp_event_t) || offset + sizeof(lsp_log_record_t) + r->size > end_)
+      return nullptr;
+    if (lsp_event_size(event(r)) != r->size)
+      return nullptr;
+    return r;
+  }
+
+  static const lsp_event_t * event(const lsp_log_record_t * record)
+  {
+    return (const lsp_event_t *)(record + 1);
+  }
+
+  static uint64_t next(uint64_t offset, const lsp_log_record_t * record)
+  {
+    return offset + sizeof(lsp_log_record_t) + align8(record->size);
+  }
+
+private:
+  mapping data_;
+  mapping index_;
+  uint64_t end_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+
+//! sequence numbers of the segments in the directory, ascending
+inline std::vector<uint64_t> list_segments(const std::string & dir)
+{
+  std::vector<uint64_t> seqs;
+  DIR * d = opendir(dir.c_str());
+  if (!d)
+    throw std::system_error(errno, std::generic_category(), dir);
+  while (struct dirent * entry = readdir(d))
+  {
+    unsigned long long seq = 0;
+    char ext[8] = {0};
+    if (sscanf(entry->d_name, "%16llx.%3s", &seq, ext) == 2 && strcmp(ext, "lsd") == 0)
+      seqs.push_back(seq);
+  }
+  closedir(d);
+  std::sort(seqs.begin(), seqs.end());
+  return seqs;
+}
+
+// ---------------------------------------------------------------------------
+
+//! writes the indexes of the trailing segments a crash left unsealed, so they
+//! are not scanned by every query; returns the count of the indexed segments.
+//! A data file cut before the end of its header holds no record, it is moved
+//! aside to <seq>.bad so that the queries do not trip over it.
+inline unsigned recover(const std::string & dir)
+{
+  unsigned recovered = 0;
+  const std::vector<uint64_t> seqs = list_segments(dir);
+  for (auto seq = seqs.rbegin(); seq != seqs.rend(); ++seq)
+  {
+    const std::string name = segment_name(dir, *seq, ".lsd");
+    struct stat st;
+    if (stat(name.c_str(), &st) == 0 && (uint64_t)st.st_size < sizeof(lsp_log_segment_header_t))
+    {
+      const std::string bad_name = segment_name(dir, *seq, ".bad");
+      if (rename(name.c_str(), bad_name.c_str()) != 0)
+	throw std::system_error(errno, std::generic_category(), name);
+      fprintf(stderr, "lsp_log: %s: truncated, moved to %s\n", name.c_str(), bad_name.c_str());
+      continue;
+    }
+    try
+    {
+      const segment seg(dir, *seq);
+      if (seg.indexed())
+	break;
+      // a torn tail record is left out of the indexed data size
+      index_builder builder;
+      uint64_t offset = sizeof(lsp_log_segment_header_t);
+      for (const lsp_log_record_t * record; (record = seg.record(offset)); offset = segment::next(offset, record))
+	builder.add(segment::event(record), record->time_ns, offset);
+      builder.write(dir, *seq, offset);
+      ++recovered;
+    }
+    catch (const std::runtime_error & e)
+    {
+      fprintf(stderr, "lsp_log: %s\n", e.what());
+    }
+  }
+  return recovered;
+}
+
+// ---------------------------------------------------------------------------
+
+//! conditions of a query, an empty optional condition matches any event
+struct filter
+{
+  uint64_t from = 0;
+  uint64_t to = UINT64_MAX;
+  bool has_path = false;
+  std::string path;
+  bool has_uid = false;
+  uint32_t uid = 0;
+  bool has_exe = false;
+  std::string exe;
+  bool has_inode = false;
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+
+  bool match(const lsp_log_record_t * record) const
+  {
+    const lsp_event_t * event = segment::event(record);
+    return (record->time_ns >= from && record->time_ns <= to
+	&& (!has_uid || event->pcred.uid == uid)
+	&& (!has_path || lsp_stream::field_value(event, 0) == path)
+	&& (!has_exe || lsp_stream::field_value(event, 1) == exe)
+	&& (!has_inode || match_inode(event))
+	);
+  }
+
+private:
+  bool match_inode(const lsp_event_t * event) const
+  {
+    lsp_event_ext_t ext;
+    return (lsp_event_ext_get(event, &ext) && ext.inode.dev == dev && ext.inode.ino == ino);
+  }
+};
+
+//! counters of the work done by query()
+struct query_stats
+{
+  uint64_t segments = 0; //! segments looked into
+  uint64_t scanned = 0;  //! records read sequentially
+  uint64_t probed = 0;   //! records read through indexes
+};
+
+//! calls on_match(record) for the records matching the filter in the segment,
+//! in the order of the index used, i.e. not necessarily in time order
+template<typename callback_t>
+void query(const segment & seg, const filter & f, callback_t && on_match, query_stats & stats)
+{
+  typedef std::pair<const lsp_log_index_entry_t *, const lsp_log_index_entry_t *> range_t;
+
+  const lsp_log_index_header_t * index = (seg.indexed() ? seg.index_header() : nullptr);
+  if (index && (index->last_ns < f.from || index->first_ns > f.to || !index->record_count))
+    return;
+  ++stats.segments;
+
+  if (index)
+  {
+    // the time range is exact, pick it or the most selective of the key indexes
+    range_t best = seg.lookup_range(LSP_LOG_INDEX_TIME, f.from, f.to);
+    auto consider = [&](lsp_log_index_kind_t kind, uint64_t key)
+    {
+      range_t r = seg.lookup(kind, key);
+      if ((r.second - r.first) < (best.second - best.first))
+	best = r;
+    };
+    if (f.has_path)
+      consider(LSP_LOG_INDEX_PATH, hash(f.path));
+    if (f.has_exe)
+      consider(LSP_LOG_INDEX_EXE, hash(f.exe));
+    if (f.has_uid)
+      consider(LSP_LOG_INDEX_UID, f.uid);
+    if (f.has_inode)
+      consider(LSP_LOG_INDEX_INODE, inode_key(f.dev, f.ino));
+
+    for (const lsp_log_index_entry_t * it = best.first; it != best.second; ++it)
+    {
+      const lsp_log_record_t * record = seg.record(it->offset);
+      ++stats.probed;
+      if (record && f.match(record))
+	on_match(record);
+    }
+    return;
+  }
+
+  for (uint64_t offset = sizeof(lsp_log_segment_header_t); const lsp_log_record_t * record = seg.record(offset); offset = segment::next(offset, record))
+  {
+    ++stats.scanned;
+    if (f.match(record))
+      on_match(record);
+  }
+}
+
+} // namespace lsp_log
+
+#endif // LSP_LOG_H
@@ -0,0 +1,185 @@
+// Ingest rate and query latency of the segment log on synthetic events
+//
+// usage: lsp_log_bench <scratch_dir> [<events>] [<queries>]
+
+#include "lsp_log.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdlib>
+#include <random>
+
+// ---------------------------------------------------------------------------
+
+typedef std::chrono::steady_clock lsp_clock_t;
+
+static double lsp_bench_seconds(lsp_clock_t::time_point started)
+{
+  return std::chrono::duration<double>(lsp_clock_t::now() - started).count();
+}
+
+// ---------------------------------------------------------------------------
+
+//! serializes an event the way lsp_kevent_serialize_to_user does
+static size_t lsp_bench_build(std::vector<char> & buffer, uint32_t uid, const std::string & path, const std::string & exe, uint64_t ino, uint64_t time_ns)
+{
+  const std::string * values[] = {&path, &exe};
+  size_t size = sizeof(lsp_event_t) + sizeof(lsp_event_field_t) + sizeof(lsp_event_ext_t);
+  for (const std::string * value : values)
+    size += sizeof(lsp_event_field_t) + value->size() + 1;
+  buffer.assign(size, 0);
+
+  lsp_event_t * event = (lsp_event_t *)buffer.data();
+  event->code = LSP_EVENT_CODE_FILE_OPEN;
+  event->pcred.uid = event->pcred.euid = event->pcred.fsuid = uid;
+  event->pcred.tgid = 1000 + uid;
+  lsp_event_field_t * field = lsp_event_field_first(event);
+  for (uint32_t number = 0; number < 2; ++number)
+  {
+    field->number = number;
+    field->size = values[number]->size() + 1;
+    memcpy(field->value, values[number]->c_str(), field->size);
+    event->data_size += sizeof(lsp_event_field_t) + field->size;
+    event->field_count++;
+    field = lsp_event_field_next(field);
+  }
+  lsp_event_ext_t ext;
+  memset(&ext, 0, sizeof(ext));
+  ext.inode.dev = 0x801;
+  ext.inode.ino = ino;
+  ext.time_ns = time_ns;
+  field->number = LSP_EVENT_FIELD_EXT;
+  field->size = sizeof(ext);
+  memcpy(field->value, &ext, sizeof(ext));
+  event->data_size += sizeof(lsp_event_field_t) + field->size;
+  event->field_count++;
+  return size;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <scratch_dir> [<events>] [<queries>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const std::string dir = argv[1];
+  const uint64_t event_count = (argc > 2 ? strtoull(argv[2], nullptr, 10) : 2000000);
+  const uint64_t query_count = (argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000);
+
+  std::mt19937_64 rng(42);
+  std::vector<std::string> paths;
+  for (int i = 0; i < 20000; ++i)
+    paths.push_back("/srv/data/project" + std::to_string(i % 97) + "/src/file" + std::to_string(i) + ".c");
+  std::vector<std::string> exes;
+  for (int i = 0; i < 200; ++i)
+    exes.push_back("/usr/bin/tool" + std::to_string(i));
+
+  try
+  {
+    if (mkdir(dir.c_str(), 0750) != 0 && errno != EEXIST)
+      throw std::system_error(errno, std::generic_category(), dir);
+    if (!lsp_log::list_segments(dir).empty())
+      throw std::runtime_error(dir + " is not empty");
+
+    // --- ingest, a second per 10000 events, one in 8 events delivered late
+    // the way critical events overtake bulk ones
+    const uint64_t base_ns = lsp_log::now_ns();
+    const uint64_t step_ns = 100000;
+    std::vector<char> buffer;
+    uint64_t bytes = 0;
+    auto started = lsp_clock_t::now();
+    {
+      lsp_log::writer writer(dir, 0, 64ULL << 20);
+      for (uint64_t i = 0; i < event_count; ++i)
+      {
+	const uint64_t late_ns = (rng() % 8 == 0 ? (rng() % 1000) * step_ns : 0);
+	const uint64_t time_ns = base_ns + i * step_ns - std::min(late_ns, i * step_ns);
+	const size_t path = rng() % paths.size();
+	bytes += lsp_bench_build(buffer, rng() % 50, paths[path], exes[rng() % exes.size()], 1000 + path, time_ns);
+	writer.append((const lsp_event_t *)buffer.data(), lsp_log::now_ns());
+      }
+    }
+    double seconds = lsp_bench_seconds(started);
+    printf("ingest: %" PRIu64 " events, %.1f MB in %.3f s: %.0f events/s, %.1f MB/s\n"
+	, event_count
+	, bytes / 1e6
+	, seconds
+	, event_count / seconds
+	, bytes / 1e6 / seconds
+	);
+
+    std::vector<lsp_log::segment> segments;
+    for (uint64_t seq : lsp_log::list_segments(dir))
+      segments.emplace_back(dir, seq);
+
+    // --- "who opened path X between T1 and T2" over a tenth of the span
+    const uint64_t span_ns = event_count * step_ns;
+    std::vector<lsp_log::filter> filters(query_count);
+    for (lsp_log::filter & f : filters)
+    {
+      f.has_path = true;
+      f.path = paths[rng() % paths.size()];
+      f.from = base_ns + rng() % span_ns;
+      f.to = f.from + span_ns / 10;
+    }
+
+    uint64_t indexed_matches = 0;
+    lsp_log::query_stats stats;
+    started = lsp_clock_t::now();
+    for (const lsp_log::filter & f : filters)
+      for (const lsp_log::segment & seg : segments)
+	lsp_log::query(seg, f, [&](const lsp_log_record_t *) { ++indexed_matches; }, stats);
+    seconds = lsp_bench_seconds(started);
+    printf("indexed query: %.1f us per query, %" PRIu64 " matches, %" PRIu64 " probed, %" PRIu64 " scanned\n"
+	, seconds * 1e6 / query_count
+	, indexed_matches
+	, stats.probed
+	, stats.scanned
+	);
+
+    // --- the same queries as a full scan, the way grep over a dump works
+    const uint64_t scan_count = std::min<uint64_t>(query_count, 20);
+    uint64_t scan_matches = 0;
+    uint64_t indexed_subset = 0;
+    started = lsp_clock_t::now();
+    for (uint64_t i = 0; i < scan_count; ++i)
+    {
+      for (const lsp_log::segment & seg : segments)
+      {
+	uint64_t offset = sizeof(lsp_log_segment_header_t);
+	while (const lsp_log_record_t * record = seg.record(offset))
+	{
+	  if (filters[i].match(record))
+	    ++scan_matches;
+	  offset = lsp_log::segment::next(offset, record);
+	}
+      }
+    }
+    seconds = lsp_bench_seconds(started);
+    for (uint64_t i = 0; i < scan_count; ++i)
+    {
+      lsp_log::query_stats unused;
+      for (const lsp_log::segment & seg : segments)
+	lsp_log::query(seg, filters[i], [&](const lsp_log_record_t *) { ++indexed_subset; }, unused);
+    }
+    printf("full scan: %.1f us per query, %" PRIu64 " matches (indexed: %" PRIu64 ")\n"
+	, seconds * 1e6 / scan_count
+	, scan_matches
+	, indexed_subset
+	);
+    if (scan_matches != indexed_subset)
+    {
+      fprintf(stderr, "lsp_log_bench: indexed and full scan results differ\n");
+      return EXIT_FAILURE;
+    }
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_log_bench: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+// Appends the lsprobe events stream into an indexed segment log, see lsp_log.h
+//
+// usage: lsp_logd <log_dir> [<events_file>] [<segment_mb>]
+
+#include "lsp_log.h"
+
+#include <csignal>
+#include <cstdlib>
+
+// ---------------------------------------------------------------------------
+
+static volatile sig_atomic_t lsp_logd_stop = 0;
+
+static void lsp_logd_on_signal(int)
+{
+  lsp_logd_stop = 1;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <log_dir> [<events_file>] [<segment_mb>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const std::string dir = argv[1];
+  const char * events_name = (argc > 2 ? argv[2] : "/sys/kernel/security/lsprobe/events");
+  const uint64_t segment_size = (argc > 3 ? strtoull(argv[3], nullptr, 10) : 64) << 20;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = lsp_logd_on_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  int fd = open(events_name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror(events_name);
+    return EXIT_FAILURE;
+  }
+
+  try
+  {
+    mkdir(dir.c_str(), 0750);
+    const unsigned recovered = lsp_log::recover(dir);
+    if (recovered)
+      fprintf(stderr, "lsp_logd: indexed %u unsealed segments\n", recovered);
+    const std::vector<uint64_t> seqs = lsp_log::list_segments(dir);
+    lsp_log::writer writer(dir, seqs.empty() ? 0 : seqs.back() + 1, segment_size);
+
+    std::vector<char> buffer(1 << 20);
+    size_t pending = 0;
+    uint64_t total = 0;
+    while (!lsp_logd_stop)
+    {
+      ssize_t rv = read(fd, buffer.data() + pending, buffer.size() - pending);
+      if (rv < 0)
+      {
+	if (errno == EINTR)
+	  continue;
+	perror(events_name);
+	break;
+      }
+      if (rv == 0)
+	break;
+      pending += rv;
+      size_t consumed = writer.append_stream(buffer.data(), pending, lsp_log::now_ns());
+      // the events are off the kernel queue, a crash must not take them along
+      writer.flush();
+      memmove(buffer.data(), buffer.data() + consumed, pending - consumed);
+      pending -= consumed;
+      total += consumed;
+    }
+    writer.seal();
+    fprintf(stderr, "lsp_logd: %llu bytes logged\n", (unsigned long long)total);
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_logd: %s\n", e.what());
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+// Queries the indexed segment log written by lsp_logd
+//
+// usage: lsp_logq <log_dir> [--from <sec>] [--to <sec>] [--path <path>] [--uid <uid>] [--exe <path>] [--inode <dev>:<ino>] [--stats]
+// times are seconds since the epoch, i.e. `date +%s`
+// dev is hex and ino decimal, as printed, i.e. `stat -c %D:%i <file>`
+
+#include "lsp_log.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cinttypes>
+
+// ---------------------------------------------------------------------------
+
+static void lsp_logq_usage(const char * name)
+{
+  fprintf(stderr, "usage: %s <log_dir> [--from <sec>] [--to <sec>] [--path <path>] [--uid <uid>] [--exe <path>] [--inode <dev>:<ino>] [--stats]\n", name);
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_logq_print(const lsp_log_record_t * record)
+{
+  const lsp_event_t * event = lsp_log::segment::event(record);
+  const std::string_view path = lsp_stream::field_value(event, 0);
+  const std::string_view exe = lsp_stream::field_value(event, 1);
+  lsp_event_ext_t ext;
+  lsp_event_ext_get(event, &ext);
+  printf("%" PRIu64 ".%09" PRIu64 " cgroup[%" PRIu64 "] tgid[%d] uid[%u] euid[%u] ino[%" PRIx64 ":%" PRIu64 "] %.*s %.*s\n"
+      , record->time_ns / 1000000000
+      , record->time_ns % 1000000000
+      , (uint64_t)ext.cgroup
+      , event->pcred.tgid
+      , event->pcred.uid
+      , event->pcred.euid
+      , (uint64_t)ext.inode.dev
+      , (uint64_t)ext.inode.ino
+      , (int)exe.size(), exe.data()
+      , (int)path.size(), path.data()
+      );
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    lsp_logq_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string dir = argv[1];
+  lsp_log::filter filter;
+  bool stats_requested = false;
+  for (int i = 2; i < argc; ++i)
+  {
+    const std::string_view arg = argv[i];
+    if (arg == "--stats")
+    {
+      stats_requested = true;
+      continue;
+    }
+    if (i + 1 >= argc)
+    {
+      lsp_logq_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    const char * value = argv[++i];
+    if (arg == "--from")
+      filter.from = strtoull(value, nullptr, 10) * 1000000000ULL;
+    else if (arg == "--to")
+      filter.to = strtoull(value, nullptr, 10) * 1000000000ULL + 999999999ULL;
+    else if (arg == "--path")
+    {
+      filter.has_path = true;
+      filter.path = value;
+    }
+    else if (arg == "--uid")
+    {
+      filter.has_uid = true;
+      filter.uid = strtoul(value, nullptr, 10);
+    }
+    else if (arg == "--exe")
+    {
+      filter.has_exe = true;
+      filter.exe = value;
+    }
+    else if (arg == "--inode")
+    {
+      char * end = nullptr;
+      filter.has_inode = true;
+      filter.dev = strtoull(value, &end, 16);
+      if (*end != ':')
+      {
+	lsp_logq_usage(argv[0]);
+	return EXIT_FAILURE;
+      }
+      filter.ino = strtoull(end + 1, nullptr, 10);
+    }
+    else
+    {
+      lsp_logq_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const auto started = std::chrono::steady_clock::now();
+  lsp_log::query_stats stats;
+  uint64_t matched = 0;
+  std::vector<uint64_t> seqs;
+  try
+  {
+    seqs = lsp_log::list_segments(dir);
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_logq: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  for (uint64_t seq : seqs)
+  {
+    // a segment that cannot be opened, e.g. one a writer is creating, costs its events only
+    try
+    {
+      const lsp_log::segment seg(dir, seq);
+      lsp_log::query(seg, filter
+	  , [&](const lsp_log_record_t * record)
+	  {
+	    lsp_logq_print(record);
+	    ++matched;
+	  }
+	  , stats
+	  );
+    }
+    catch (const std::exception & e)
+    {
+      fprintf(stderr, "lsp_logq: skipped: %s\n", e.what());
+    }
+  }
+
+  if (stats_requested)
+  {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+    fprintf(stderr, "lsp_logq: %" PRIu64 " matched, %" PRIu64 " segments, %" PRIu64 " scanned, %" PRIu64 " probed, %lld us\n"
+	, matched
+	, stats.segments
+	, stats.scanned
+	, stats.probed
+	, (long long)elapsed.count()
+	);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,499 @@
+#ifndef LSP_MATCH_H
+#define LSP_MATCH_H
+
+// Multi-pattern path matcher for IOC lookups on event paths.
+//
+// A pattern without wildcards is a path prefix, a pattern with '*' (any sequence,
+// '/' included) or '?' (any single byte) is a glob matched against the whole path.
+//
+// Prefixes are reduced to a prefix-free set sorted by value, so at most one of them
+// can be a prefix of a path and it precedes the path in the order: a binary search
+// over 8-byte big-endian keys finds it.
+// Globs are found through the rarest 4-byte gram of their literal runs (the anchor):
+// an SSSE3 nibble shuffle filter over the first three bytes of the anchors flags
+// candidate positions 16 at a time, a bloom filter and a table of the anchor grams
+// narrow them down and the candidate globs are verified in full.
+// Globs with literal runs shorter than four bytes are verified for every path.
+// A batch runs the filter over all its paths before verifying any candidate,
+// so the filter loop is not interleaved with the table and glob lookups.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+// ---------------------------------------------------------------------------
+
+namespace lsp_match
+{
+
+constexpr uint32_t none = UINT32_MAX;
+
+// ---------------------------------------------------------------------------
+
+inline bool is_glob(std::string_view pattern)
+{
+  return pattern.find_first_of("*?") != std::string_view::npos;
+}
+
+//! whole-string glob match, '*' backtracks to the last star only
+inline bool glob_match(std::string_view pattern, std::string_view text)
+{
+  size_t p = 0;
+  size_t t = 0;
+  size_t star = std::string_view::npos;
+  size_t star_t = 0;
+  while (t < text.size())
+  {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+    {
+      ++p;
+      ++t;
+    }
+    else if (p < pattern.size() && pattern[p] == '*')
+    {
+      star = p++;
+      star_t = t;
+    }
+    else if (star != std::string_view::npos)
+    {
+      p = star + 1;
+      t = ++star_t;
+    }
+    else
+      return false;
+  }
+  while (p < pattern.size() && pattern[p] == '*')
+    ++p;
+  return p == pattern.size();
+}
+
+inline bool pattern_match(std::string_view pattern, std::string_view path)
+{
+  return (is_glob(pattern)
+      ? glob_match(pattern, path)
+      : path.compare(0, pattern.size(), pattern) == 0
+      );
+}
+
+// ---------------------------------------------------------------------------
+
+//! reference matcher: every pattern in order against every path
+class naive_set
+{
+public:
+  explicit naive_set(std::vector<std::string> patterns)
+    : patterns_(std::move(patterns))
+  {
+  }
+
+  uint32_t match(std::string_view path) const
+  {
+    for (uint32_t id = 0; id < patterns_.size(); ++id)
+      if (pattern_match(patterns_[id], path))
+	return id;
+    return none;
+  }
+
+private:
+  std::vector<std::string> patterns_;
+};
+
+// ---------------------------------------------------------------------------
+
+//! compiled pattern set, match() returns the id (index) of some matching pattern
+class pattern_set
+{
+public:
+  explicit pattern_set(const std::vector<std::string> & patterns)
+    : patterns_(patterns)
+    , grams_(1 << 13, 0)
+    , verified_(patterns.size(), 0)
+  {
+    compile_prefixes();
+    compile_globs();
+  }
+
+  uint32_t match(std::string_view path) const
+  {
+    const uint32_t id = match_direct(path);
+    if (id != none || globs_.empty() || path.size() < 4)
+      return id;
+
+    // the scan reads up to 18 bytes past the last position
+    scratch_.resize(path.size() + 32);
+    memcpy(scratch_.data(), path.data(), path.size());
+    memset(scratch_.data() + path.size(), 0, 32);
+    next_serial();
+    uint32_t found = none;
+    scan(scratch_.data(), path.size() - 3
+	, [&](size_t pos) { found = verify(scratch_.data(), path, pos); return found != none; }
+	);
+    return found;
+  }
+
+  //! matches a batch, results[i] receives the id for paths[i] or none;
+  //! the same ids as match() path by path
+  void match(const std::string_view * paths, size_t count, uint32_t * results) const
+  {
+    // the padded copies of the paths left to the globs and their candidate positions
+    batch_.clear();
+    candidates_.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+      const std::string_view path = paths[i];
+      results[i] = match_direct(path);
+      if (results[i] != none || globs_.empty() || path.size() < 4)
+	continue;
+      const size_t offset = batch_.size();
+      batch_.resize(offset + path.size() + 32, 0);
+      memcpy(batch_.data() + offset, path.data(), path.size());
+      const char * data = batch_.data() + offset;
+      scan(data, path.size() - 3
+	  , [&](size_t pos)
+	  {
+	    // the bloom filter is in L1, the group table may not be: its slot is
+	    // prefetched now and read when the candidate is verified
+	    const uint32_t h = gram_hash(gram(data + pos));
+	    if (grams_[h >> 3] & (1 << (h & 7)))
+	    {
+	      __builtin_prefetch(&groups_[h & (groups_.size() - 1)]);
+	      candidates_.push_back({(uint32_t)i, (uint32_t)offset, (uint32_t)pos});
+	    }
+	    return false;
+	  }
+	  );
+    }
+
+    // candidates are in path then position order, the first verified one wins
+    size_t current = count;
+    for (const candidate_t & c : candidates_)
+    {
+      if (results[c.index] != none)
+	continue;
+      if (c.index != current)
+      {
+	current = c.index;
+	next_serial();
+      }
+      results[c.index] = verify(batch_.data() + c.offset, paths[c.index], c.pos);
+    }
+  }
+
+  const std::string & pattern(uint32_t id) const { return patterns_[id]; }
+
+private:
+  struct prefix_t
+  {
+    uint64_t key; //! first 8 bytes, big-endian, zero padded
+    uint32_t id;
+  };
+
+  static uint64_t key(std::string_view value)
+  {
+    unsigned char bytes[8] = {0};
+    memcpy(bytes, value.data(), std::min<size_t>(8, value.size()));
+    uint64_t k = 0;
+    for (unsigned char b : bytes)
+      k = (k << 8) | b;
+    return k;
+  }
+
+  static uint32_t gram(const char * value)
+  {
+    uint32_t g;
+    memcpy(&g, value, sizeof(g));
+    return g;
+  }
+
+  static uint32_t gram_hash(uint32_t g)
+  {
+    return (g * 0x9e3779b1u) >> 16;
+  }
+
+  // -------------------------------------------------------------------------
+
+  void compile_prefixes()
+  {
+    std::vector<uint32_t> ids;
+    for (uint32_t id = 0; id < patterns_.size(); ++id)
+      if (!is_glob(patterns_[id]))
+	ids.push_back(id);
+    std::sort(ids.begin(), ids.end()
+	, [this](uint32_t l, uint32_t r) { return patterns_[l] < patterns_[r]; }
+	);
+    // a prefix of a kept pattern sorts before it, so one pass drops the covered ones
+    for (uint32_t id : ids)
+    {
+      if (!prefixes_.empty() && std::string_view(patterns_[id]).compare(0, patterns_[prefixes_.back().id].size(), patterns_[prefixes_.back().id]) == 0)
+	continue;
+      prefixes_.push_back({key(patterns_[id]), id});
+    }
+  }
+
+  //! the prefixes and the globs without an anchor
+  uint32_t match_direct(std::string_view path) const
+  {
+    const uint32_t id = match_prefix(path);
+    if (id != none)
+      return id;
+    for (uint32_t g : short_globs_)
+      if (glob_match(patterns_[g], path))
+	return g;
+    return none;
+  }
+
+  uint32_t match_prefix(std::string_view path) const
+  {
+    if (prefixes_.empty())
+      return none;
+    // the candidate is the last prefix <= path, equal keys are resolved by value
+    const uint64_t k = key(path);
+    auto it = std::upper_bound(prefixes_.begin(), prefixes_.end(), k
+	, [](uint64_t l, const prefix_t & r) { return l < r.key; }
+	);
+    while (it != prefixes_.begin())
+    {
+      --it;
+      const std::string & prefix = patterns_[it->id];
+      const int cmp = path.compare(0, prefix.size(), prefix);
+      if (cmp == 0)
+	return it->id;
+      if (cmp > 0 || it->key != k)
+	return none;
+    }
+    return none;
+  }
+
+  // -------------------------------------------------------------------------
+
+  void compile_globs()
+  {
+    // grams shared by many globs, i.e. "/usr", flag too many positions
+    std::unordered_map<uint32_t, uint32_t> frequency;
+    for (const std::string & pattern : patterns_)
+    {
+      if (!is_glob(pattern))
+	continue;
+      for (size_t i = 0; i + 4 <= pattern.size(); ++i)
+	if (pattern.find_first_of("*?", i) >= i + 4)
+	  ++frequency[gram(pattern.data() + i)];
+    }
+
+    uint8_t lo[3][16] = {{0}};
+    uint8_t hi[3][16] = {{0}};
+    for (uint32_t id = 0; id < patterns_.size(); ++id)
+    {
+      const std::string & pattern = patterns_[id];
+      if (!is_glob(pattern))
+	continue;
+
+      // the rarest gram of the literal runs, the anchor extends to the end of its run
+      size_t best = 0;
+      size_t best_size = 0;
+      uint32_t best_frequency = UINT32_MAX;
+      for (size_t begin = 0; begin < pattern.size(); )
+      {
+	const size_t end = std::min(pattern.find_first_of("*?", begin), pattern.size());
+	for (size_t i = begin; i + 4 <= end; ++i)
+	{
+	  const uint32_t f = frequency[gram(pattern.data() + i)];
+	  if (f < best_frequency || (f == best_frequency && end - i > best_size))
+	  {
+	    best = i;
+	    best_size = end - i;
+	    best_frequency = f;
+	  }
+	}
+	begin = end + 1;
+      }
+      if (best_size < 4)
+      {
+	short_globs_.push_back(id);
+	continue;
+      }
+
+      const char * anchor = pattern.data() + best;
+      const uint32_t g = gram(anchor);
+      const uint8_t bucket = (uint8_t)(1 << ((g * 0x9e3779b1u) >> 29));
+      for (int i = 0; i < 3; ++i)
+      {
+	lo[i][(unsigned char)anchor[i] & 0xf] |= bucket;
+	hi[i][(unsigned char)anchor[i] >> 4] |= bucket;
+      }
+      const uint32_t h = gram_hash(g);
+      grams_[h >> 3] |= (uint8_t)(1 << (h & 7));
+      anchor_t a;
+      a.gram = g;
+      a.id = id;
+      a.offset = (uint32_t)best;
+      a.size = (uint32_t)best_size;
+      a.head = 0;
+      memcpy(&a.head, anchor, std::min<size_t>(8, best_size));
+      a.head_mask = (best_size >= 8 ? ~0ULL : (1ULL << (8 * best_size)) - 1);
+      anchors_.push_back(a);
+      globs_.push_back(id);
+    }
+
+    // anchors grouped by gram, an open addressing table points to the groups
+    std::sort(anchors_.begin(), anchors_.end()
+	, [](const anchor_t & l, const anchor_t & r) { return l.gram < r.gram; }
+	);
+    size_t slots = 16;
+    while (slots < 2 * anchors_.size())
+      slots *= 2;
+    groups_.assign(slots, group_t{0, 0, 0});
+    for (uint32_t begin = 0; begin < anchors_.size(); )
+    {
+      uint32_t end = begin;
+      while (end < anchors_.size() && anchors_[end].gram == anchors_[begin].gram)
+	++end;
+      size_t slot = gram_hash(anchors_[begin].gram) & (groups_.size() - 1);
+      while (groups_[slot].end)
+	slot = (slot + 1) & (groups_.size() - 1);
+      groups_[slot] = {anchors_[begin].gram, begin, end};
+      begin = end;
+    }
+
+#ifdef __SSSE3__
+    for (int i = 0; i < 3; ++i)
+    {
+      lo_[i] = _mm_loadu_si128((const __m128i *)lo[i]);
+      hi_[i] = _mm_loadu_si128((const __m128i *)hi[i]);
+    }
+#endif
+  }
+
+  void next_serial() const
+  {
+    if (++serial_ == 0)
+    {
+      std::fill(verified_.begin(), verified_.end(), 0);
+      serial_ = 1;
+    }
+  }
+
+  //! verifies the globs anchored at the position, data is the padded copy of the path
+  uint32_t verify(const char * data, std::string_view path, size_t pos) const
+  {
+    const uint32_t g = gram(data + pos);
+    const uint32_t h = gram_hash(g);
+    if (!(grams_[h >> 3] & (1 << (h & 7))))
+      return none;
+    const group_t * group = nullptr;
+    for (size_t slot = h & (groups_.size() - 1); groups_[slot].end; slot = (slot + 1) & (groups_.size() - 1))
+    {
+      if (groups_[slot].key == g)
+      {
+	group = &groups_[slot];
+	break;
+      }
+    }
+    if (!group)
+      return none;
+
+    uint64_t head;
+    memcpy(&head, data + pos, sizeof(head));
+    for (uint32_t i = group->begin; i < group->end; ++i)
+    {
+      const anchor_t & a = anchors_[i];
+      if ((head & a.head_mask) != a.head
+	  || pos + a.size > path.size()
+	  || verified_[a.id] == serial_
+	  || (a.size > 8 && memcmp(path.data() + pos + 8, patterns_[a.id].data() + a.offset + 8, a.size - 8) != 0))
+	continue;
+      verified_[a.id] = serial_;
+      if (glob_match(patterns_[a.id], path))
+	return a.id;
+    }
+    return none;
+  }
+
+  //! calls on_candidate(pos) for the positions of data the filter flags, in order,
+  //! until it returns true; data is padded with 32 bytes
+  template<typename callback_t>
+  void scan(const char * data, size_t positions, callback_t && on_candidate) const
+  {
+    size_t pos = 0;
+#ifdef __SSSE3__
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; pos < positions; pos += 16)
+    {
+      __m128i candidates = _mm_set1_epi8((char)0xff);
+      for (int i = 0; i < 3; ++i)
+      {
+	const __m128i v = _mm_loadu_si128((const __m128i *)(data + pos + i));
+	const __m128i l = _mm_shuffle_epi8(lo_[i], _mm_and_si128(v, nibble));
+	const __m128i h = _mm_shuffle_epi8(hi_[i], _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	candidates = _mm_and_si128(candidates, _mm_and_si128(l, h));
+      }
+      uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(candidates, _mm_setzero_si128())) & 0xffff;
+      if (positions - pos < 16)
+	mask &= (1u << (positions - pos)) - 1;
+      for (; mask; mask &= mask - 1)
+	if (on_candidate(pos + __builtin_ctz(mask)))
+	  return;
+    }
+#else
+    (void)data;
+    for (; pos < positions; ++pos)
+      if (on_candidate(pos))
+	return;
+#endif
+  }
+
+  // -------------------------------------------------------------------------
+
+  struct anchor_t
+  {
+    uint64_t head;      //! first 8 bytes of the anchor, as loaded on little-endian
+    uint64_t head_mask; //! of the head bytes for anchors shorter than 8
+    uint32_t gram;
+    uint32_t id;
+    uint32_t offset; //! of the anchor in the pattern
+    uint32_t size;
+  };
+
+  struct candidate_t
+  {
+    uint32_t index;  //! of the path in the batch
+    uint32_t offset; //! of its copy in batch_
+    uint32_t pos;
+  };
+
+  struct group_t
+  {
+    uint32_t key; //! gram
+    uint32_t begin;
+    uint32_t end; //! zero marks an empty slot
+  };
+
+  std::vector<std::string> patterns_;
+  std::vector<prefix_t> prefixes_;
+  std::vector<uint32_t> globs_;
+  std::vector<uint32_t> short_globs_;
+  std::vector<uint8_t> grams_; //! 64 Kbit bloom filter of the anchor grams, fits L1
+  std::vector<anchor_t> anchors_;
+  std::vector<group_t> groups_;
+#ifdef __SSSE3__
+  __m128i lo_[3];
+  __m128i hi_[3];
+#endif
+  // per-call state, a pattern_set is not shared between threads
+  mutable std::vector<char> scratch_;
+  mutable std::vector<char> batch_;
+  mutable std::vector<candidate_t> candidates_;
+  mutable std::vector<uint32_t> verified_;
+  mutable uint32_t serial_ = 0;
+};
+
+} // namespace lsp_match
+
+#endif // LSP_MATCH_H
@@ -0,0 +1,193 @@
+// Compiled pattern set against naive per-pattern matching on event paths
+//
+// usage: lsp_match_bench <patterns_file | --synthetic <count>> [<capture>] [--loop <n>]
+//
+// patterns_file holds a pattern per line, see lsp_match.h for the syntax.
+// The paths are fields 0 and 1 of the events in a lsp_replay capture or
+// synthetic ones when no capture is given.
+// Build with -march=native (or at least -mssse3) to enable the SIMD filter.
+
+#include "lsp_capture.h"
+#include "lsp_match.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+
+// ---------------------------------------------------------------------------
+
+typedef std::chrono::steady_clock lsp_clock_t;
+
+static double lsp_bench_seconds(lsp_clock_t::time_point started)
+{
+  return std::chrono::duration<double>(lsp_clock_t::now() - started).count();
+}
+
+// ---------------------------------------------------------------------------
+
+static std::vector<std::string> lsp_bench_synthetic_patterns(size_t count, std::mt19937_64 & rng)
+{
+  static const char * const dirs[] = {"/usr/lib", "/usr/bin", "/etc", "/tmp", "/var/tmp", "/home/user", "/opt", "/dev/shm"};
+  static const char * const exts[] = {".so", ".sh", ".py", ".ko", ".bin", ".elf"};
+  std::vector<std::string> patterns;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const std::string dir = dirs[rng() % (sizeof(dirs) / sizeof(dirs[0]))];
+    const std::string name = "ioc" + std::to_string(rng() % 1000000);
+    switch (rng() % 4)
+    {
+      case 0: patterns.push_back("*/" + name + exts[rng() % (sizeof(exts) / sizeof(exts[0]))]); break;
+      case 1: patterns.push_back(dir + "/*/" + name + "*"); break;
+      default: patterns.push_back(dir + "/" + name); break;
+    }
+  }
+  return patterns;
+}
+
+// ---------------------------------------------------------------------------
+
+static std::vector<std::string> lsp_bench_synthetic_paths(size_t count, const std::vector<std::string> & patterns, std::mt19937_64 & rng)
+{
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (rng() % 1000 == 0 && !patterns.empty())
+    {
+      // a hit, wildcards replaced with something
+      std::string path = patterns[rng() % patterns.size()];
+      for (char & c : path)
+	if (c == '*' || c == '?')
+	  c = 'x';
+      paths.push_back(path);
+    }
+    else
+      paths.push_back("/usr/src/linux-headers-5.0/include/linux/file" + std::to_string(rng() % 100000) + ".h");
+  }
+  return paths;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <patterns_file | --synthetic <count>> [<capture>] [--loop <n>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::mt19937_64 rng(42);
+  std::vector<std::string> patterns;
+  int arg = 1;
+  if (std::string(argv[arg]) == "--synthetic" && arg + 1 < argc)
+  {
+    patterns = lsp_bench_synthetic_patterns(strtoull(argv[arg + 1], nullptr, 10), rng);
+    arg += 2;
+  }
+  else
+  {
+    std::ifstream in(argv[arg++]);
+    for (std::string line; std::getline(in, line); )
+      if (!line.empty())
+	patterns.push_back(line);
+  }
+
+  const char * capture_name = nullptr;
+  uint64_t loops = 1;
+  for (; arg < argc; ++arg)
+  {
+    if (std::string(argv[arg]) == "--loop" && arg + 1 < argc)
+      loops = strtoull(argv[++arg], nullptr, 10);
+    else
+      capture_name = argv[arg];
+  }
+
+  std::vector<std::string> paths;
+  try
+  {
+    if (capture_name)
+    {
+      const lsp_capture::reader capture(capture_name);
+      lsp_stream::splitter splitter;
+      for (const lsp_capture::reader::chunk & chunk : capture.chunks())
+      {
+	splitter.feed(chunk.data, chunk.size
+	    , [&](const lsp_event_t * event)
+	    {
+	      for (uint32_t number = 0; number < 2; ++number)
+	      {
+		const std::string_view path = lsp_stream::field_value(event, number);
+		if (!path.empty())
+		  paths.emplace_back(path);
+	      }
+	    }
+	    );
+      }
+    }
+    else
+      paths = lsp_bench_synthetic_paths(1000000, patterns, rng);
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_match_bench: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string_view> views(paths.begin(), paths.end());
+  std::vector<uint32_t> results(views.size());
+  const size_t batch = 256;
+
+  auto started = lsp_clock_t::now();
+  const lsp_match::pattern_set compiled(patterns);
+  printf("compile: %zu patterns in %.3f s\n", patterns.size(), lsp_bench_seconds(started));
+
+  uint64_t hits = 0;
+  started = lsp_clock_t::now();
+  for (uint64_t loop = 0; loop < loops; ++loop)
+    for (size_t i = 0; i < views.size(); i += batch)
+      compiled.match(views.data() + i, std::min(batch, views.size() - i), results.data() + i);
+  double seconds = lsp_bench_seconds(started);
+  uint64_t mismatches = 0;
+  for (size_t i = 0; i < views.size(); ++i)
+  {
+    if (results[i] == lsp_match::none)
+      continue;
+    ++hits;
+    mismatches += !lsp_match::pattern_match(patterns[results[i]], views[i]);
+  }
+  printf("compiled: %zu paths x %" PRIu64 " in %.3f s: %.0f paths/s, %" PRIu64 " hits\n"
+      , views.size(), loops, seconds, views.size() * loops / seconds, hits);
+
+  // the same paths one at a time, the batches must return the same ids
+  started = lsp_clock_t::now();
+  for (uint64_t loop = 0; loop < loops; ++loop)
+    for (size_t i = 0; i < views.size(); ++i)
+      mismatches += (compiled.match(views[i]) != results[i]);
+  seconds = lsp_bench_seconds(started);
+  printf("single: %zu paths x %" PRIu64 " in %.3f s: %.0f paths/s\n"
+      , views.size(), loops, seconds, views.size() * loops / seconds);
+
+  // the naive matcher is orders of magnitude slower, a sample is enough
+  const size_t sample = std::min<size_t>(views.size(), 2000);
+  const lsp_match::naive_set naive(patterns);
+  uint64_t naive_hits = 0;
+  started = lsp_clock_t::now();
+  for (size_t i = 0; i < sample; ++i)
+  {
+    const uint32_t id = naive.match(views[i]);
+    naive_hits += (id != lsp_match::none);
+    mismatches += ((id == lsp_match::none) != (results[i] == lsp_match::none));
+  }
+  seconds = lsp_bench_seconds(started);
+  printf("naive: %zu paths in %.3f s: %.0f paths/s, %" PRIu64 " hits\n"
+      , sample, seconds, sample / seconds, naive_hits);
+
+  if (mismatches)
+  {
+    fprintf(stderr, "lsp_match_bench: %" PRIu64 " results differ from the single or the naive matcher\n", mismatches);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+// Records the lsprobe events stream and replays it to benchmark consumers offline
+//
+// usage:
+//   lsp_replay record <capture> [<events_file>]
+//   lsp_replay play <capture> [--speed <x> | --flat] [--loop <n>] [--out <file>]
+//   lsp_replay decode <capture> [--loop <n>]
+//
+// play writes the recorded bytes with the original read() boundaries to stdout
+// or to --out (a pipe, a fifo or a regular file standing in for the events file),
+// pacing them at the recorded timing divided by --speed or with no pacing at all.
+// decode walks every event and field in-process to measure the decode path.
+
+#include "lsp_capture.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------------------
+
+static volatile sig_atomic_t lsp_replay_stop = 0;
+
+static void lsp_replay_on_signal(int)
+{
+  lsp_replay_stop = 1;
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_replay_usage(const char * name)
+{
+  fprintf(stderr
+      , "usage:\n"
+	"  %s record <capture> [<events_file>]\n"
+	"  %s play <capture> [--speed <x> | --flat] [--loop <n>] [--out <file>]\n"
+	"  %s decode <capture> [--loop <n>]\n"
+      , name, name, name
+      );
+}
+
+// ---------------------------------------------------------------------------
+
+static void lsp_replay_report(const char * what, uint64_t events, uint64_t bytes, double seconds)
+{
+  fprintf(stderr, "lsp_replay: %s %" PRIu64 " events, %.1f MB in %.3f s: %.0f events/s, %.1f MB/s\n"
+      , what
+      , events
+      , bytes / 1e6
+      , seconds
+      , events / seconds
+      , bytes / 1e6 / seconds
+      );
+}
+
+// ---------------------------------------------------------------------------
+
+static int lsp_replay_record(const std::string & capture_name, const char * events_name)
+{
+  int fd = open(events_name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror(events_name);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t events = 0;
+  uint64_t bytes = 0;
+  const auto started = std::chrono::steady_clock::now();
+  try
+  {
+    lsp_capture::writer capture(capture_name);
+    lsp_stream::splitter splitter;
+    std::vector<char> buffer(1 << 20);
+    while (!lsp_replay_stop)
+    {
+      ssize_t rv = read(fd, buffer.data(), buffer.size());
+      if (rv < 0)
+      {
+	if (errno == EINTR)
+	  continue;
+	perror(events_name);
+	break;
+      }
+      if (rv == 0)
+	break;
+      capture.append(buffer.data(), rv);
+      splitter.feed(buffer.data(), rv, [&](const lsp_event_t *) { ++events; });
+      bytes += rv;
+    }
+    capture.flush();
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_replay: %s\n", e.what());
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  lsp_replay_report("recorded", events, bytes, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+  return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+
+static bool lsp_replay_write(int fd, const char * data, size_t size)
+{
+  while (size)
+  {
+    ssize_t rv = write(fd, data, size);
+    if (rv < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      if (errno != EPIPE)
+	perror("lsp_replay: write");
+      return false;
+    }
+    data += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+
+//! speed <= 0 replays with no pacing
+static int lsp_replay_play(const lsp_capture::reader & capture, double speed, uint64_t loops, const char * out_name)
+{
+  int fd = STDOUT_FILENO;
+  if (out_name)
+  {
+    fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+      perror(out_name);
+      return EXIT_FAILURE;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const std::vector<lsp_capture::reader::chunk> & chunks = capture.chunks();
+  const uint64_t duration_ns = (chunks.empty() ? 0 : chunks.back().offset_ns);
+  const uint64_t started_ns = lsp_capture::clock_ns(CLOCK_MONOTONIC);
+  uint64_t events = 0;
+  uint64_t bytes = 0;
+  bool ok = true;
+  lsp_stream::splitter splitter;
+
+  for (uint64_t loop = 0; ok && loop < loops && !lsp_replay_stop; ++loop)
+  {
+    for (const lsp_capture::reader::chunk & chunk : chunks)
+    {
+      if (lsp_replay_stop)
+	break;
+      if (speed > 0)
+      {
+	const uint64_t offset_ns = loop * duration_ns + chunk.offset_ns;
+	const uint64_t deadline_ns = started_ns + (uint64_t)(offset_ns / speed);
+	struct timespec deadline = {(time_t)(deadline_ns / 1000000000), (long)(deadline_ns % 1000000000)};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR && !lsp_replay_stop)
+	  ;
+      }
+      if (!(ok = lsp_replay_write(fd, chunk.data, chunk.size)))
+	break;
+      splitter.feed(chunk.data, chunk.size, [&](const lsp_event_t *) { ++events; });
+      bytes += chunk.size;
+    }
+  }
+
+  if (fd != STDOUT_FILENO)
+    close(fd);
+  lsp_replay_report("replayed", events, bytes, (lsp_capture::clock_ns(CLOCK_MONOTONIC) - started_ns) / 1e9);
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// ---------------------------------------------------------------------------
+
+static int lsp_replay_decode(const lsp_capture::reader & capture, uint64_t loops)
+{
+  uint64_t events = 0;
+  uint64_t fields = 0;
+  uint64_t checksum = 0;
+  const auto started = std::chrono::steady_clock::now();
+
+  lsp_stream::splitter splitter;
+  for (uint64_t loop = 0; loop < loops; ++loop)
+  {
+    for (const lsp_capture::reader::chunk & chunk : capture.chunks())
+    {
+      splitter.feed(chunk.data, chunk.size
+	  , [&](const lsp_event_t * event)
+	  {
+	    const lsp_event_field_t * end = lsp_event_field_end(event);
+	    for (const lsp_event_field_t * field = lsp_event_field_first_const(event); field < end; field = lsp_event_field_next_const(field))
+	    {
+	      checksum += field->size + (unsigned char)field->value[0];
+	      ++fields;
+	    }
+	    checksum += event->pcred.uid;
+	    ++events;
+	  }
+	  );
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  lsp_replay_report("decoded", events, capture.bytes() * loops, seconds);
+  fprintf(stderr, "lsp_replay: %" PRIu64 " fields, checksum %016" PRIx64 "\n", fields, checksum);
+  return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3)
+  {
+    lsp_replay_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = lsp_replay_on_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  const std::string command = argv[1];
+  const std::string capture_name = argv[2];
+  if (command == "record")
+    return lsp_replay_record(capture_name, argc > 3 ? argv[3] : "/sys/kernel/security/lsprobe/events");
+
+  double speed = 1.0;
+  uint64_t loops = 1;
+  const char * out_name = nullptr;
+  for (int i = 3; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if (arg == "--flat")
+      speed = 0;
+    else if (arg == "--speed" && i + 1 < argc)
+      speed = strtod(argv[++i], nullptr);
+    else if (arg == "--loop" && i + 1 < argc)
+      loops = strtoull(argv[++i], nullptr, 10);
+    else if (arg == "--out" && i + 1 < argc)
+      out_name = argv[++i];
+    else
+    {
+      lsp_replay_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  try
+  {
+    const lsp_capture::reader capture(capture_name);
+    if (command == "play")
+      return lsp_replay_play(capture, speed, loops, out_name);
+    if (command == "decode")
+      return lsp_replay_decode(capture, loops);
+  }
+  catch (const std::exception & e)
+  {
+    fprintf(stderr, "lsp_replay: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  lsp_replay_usage(argv[0]);
+  return EXIT_FAILURE;
+}
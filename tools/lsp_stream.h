@@ -0,0 +1,71 @@
+#ifndef LSP_STREAM_H
+#define LSP_STREAM_H
+
+// Walking the raw events stream: a read() on the events file returns whole
+// records, a chunk of a capture or a pipe may split one between two reads.
+
+#include "../lsp_event.h"
+
+#include <string_view>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+
+namespace lsp_stream
+{
+
+//! calls on_event for each complete record, returns the consumed size
+template<typename callback_t>
+size_t for_each_event(const char * buffer, size_t size, callback_t && on_event)
+{
+  size_t pos = 0;
+  while (size - pos >= sizeof(lsp_event_t))
+  {
+    const lsp_event_t * event = (const lsp_event_t *)(buffer + pos);
+    if (size - pos < lsp_event_size(event))
+      break;
+    on_event(event);
+    pos += lsp_event_size(event);
+  }
+  return pos;
+}
+
+// ---------------------------------------------------------------------------
+
+//! for_each_event over consecutive chunks, keeps a record split between chunks
+class splitter
+{
+public:
+  template<typename callback_t>
+  void feed(const char * data, size_t size, callback_t && on_event)
+  {
+    if (!pending_.empty())
+    {
+      pending_.insert(pending_.end(), data, data + size);
+      const size_t consumed = for_each_event(pending_.data(), pending_.size(), on_event);
+      pending_.erase(pending_.begin(), pending_.begin() + consumed);
+      return;
+    }
+    const size_t consumed = for_each_event(data, size, on_event);
+    pending_.assign(data + consumed, data + size);
+  }
+
+private:
+  std::vector<char> pending_;
+};
+
+// ---------------------------------------------------------------------------
+
+//! string value of a field without its NUL, which still follows data(),
+//! empty if the event lacks the field
+inline std::string_view field_value(const lsp_event_t * event, uint32_t number)
+{
+  const lsp_event_field_t * field = lsp_event_field_get_const(event, number);
+  if (!field || field >= lsp_event_field_end(event) || !field->size)
+    return {};
+  return std::string_view(field->value, field->size - 1);
+}
+
+} // namespace lsp_stream
+
+#endif // LSP_STREAM_H